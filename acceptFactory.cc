@@ -18,24 +18,66 @@
 #include <pwd.h>
 #include <grp.h>
 #include <string.h>
+#include <fcntl.h>
 #include <sstream>
+#include <algorithm>
+#include <vector>
 
 #include "procServ.h"
+#include "childInstance.h"
+#include "eventLoop.h"
+#include "metrics.h"
+
+// Max. number of connections accepted per wakeup, so that a storm of
+// (re)connecting clients can not starve the other connections
+#define ACCEPT_BATCH 32
+
+// Back-off [ms] for listeners that ran out of fds or memory while accepting
+#define ACCEPT_RETRY_MIN 50
+#define ACCEPT_RETRY_MAX 2000
+
+// Wrapper to ignore return values
+template<typename T>
+inline void ignore_result(T /* unused result */) {}
 
 struct acceptItem : public connectionItem
 {
-    acceptItem(bool readonly) :connectionItem(-1, readonly) {}
+    acceptItem(bool readonly, connectionFactory factory, int backlog,
+               childInstance *instance)
+        :connectionItem(-1, readonly, instance), factory(factory), backlog(backlog) {}
     virtual ~acceptItem();
 
     void readFromFd(void);
     int Send(const char *, int);
 
     virtual void remakeConnection()=0;
+    // Puts the new socket into listen mode (non-blocking, close-on-exec)
+    void listenOn();
+
+    // Creates the items for accepted connections
+    connectionFactory factory;
+    // Length of the queue of pending connections (listen())
+    int backlog;
+    // Only client endpoints are published (info file, environment)
+    bool published() const { return factory == clientFactory; }
+
+    // Stop accepting until acceptRetryTimer expires (out of fds, memory):
+    // the listener is level-triggered and would wake up the loop at once
+    void pauseAccept();
+    static void resumeAccept();
+    static std::vector<acceptItem *> paused;
+    static eventTimer acceptRetryTimer;
+    static long retryMs;
 };
 
+std::vector<acceptItem *> acceptItem::paused;
+eventTimer acceptItem::acceptRetryTimer(acceptItem::resumeAccept);
+long acceptItem::retryMs = ACCEPT_RETRY_MIN;
+
 struct acceptItemTCP : public acceptItem
 {
-    acceptItemTCP(const sockaddr_in& addr, bool readonly);
+    acceptItemTCP(const sockaddr_in& addr, bool readonly, connectionFactory factory,
+                  int backlog, childInstance *instance);
     virtual ~acceptItemTCP() {}
 
     sockaddr_in addr;
@@ -43,6 +85,7 @@ struct acceptItemTCP : public acceptItem
     virtual void remakeConnection();
 
     virtual void writeAddress(std::ostream& fp) {
+        if(!published()) return;
         char buf[40] = "";
         inet_ntop(addr.sin_family, &addr.sin_addr, buf, sizeof(buf));
         buf[sizeof(buf)-1] = '\0';
@@ -50,6 +93,7 @@ struct acceptItemTCP : public acceptItem
     }
 
     virtual void writeAddressEnv(std::ostringstream& env_var) {
+        if(!published()) return;
         char buf[40] = "";
         inet_ntop(addr.sin_family, &addr.sin_addr, buf, sizeof(buf));
         buf[sizeof(buf)-1] = '\0';
@@ -65,7 +109,8 @@ struct acceptItemTCP : public acceptItem
 #ifdef USOCKS
 struct acceptItemUNIX : public acceptItem
 {
-    acceptItemUNIX(const char* path, bool readonly);
+    acceptItemUNIX(const char* path, bool readonly, connectionFactory factory,
+                   int backlog, childInstance *instance);
     virtual ~acceptItemUNIX();
 
     sockaddr_un addr;
@@ -78,6 +123,7 @@ struct acceptItemUNIX : public acceptItem
     virtual void remakeConnection();
 
     virtual void writeAddress(std::ostream& fp) {
+        if(!published()) return;
         if(abstract) {
             fp<<"unix:@"<<&addr.sun_path[1]<<"\n";
         } else {
@@ -86,6 +132,7 @@ struct acceptItemUNIX : public acceptItem
     }
 
     virtual void writeAddressEnv(std::ostringstream& env_var) {
+        if(!published()) return;
         if(_readonly) {
             env_var<<"LOG=";
         } else {
@@ -101,15 +148,29 @@ struct acceptItemUNIX : public acceptItem
 #endif
 
 // service and calls clientFactory when clients are accepted
-connectionItem * acceptFactory (const char *spec, bool local, bool readonly)
+connectionItem * acceptFactory (const char *spec, bool local, bool readonly,
+                                connectionFactory factory, childInstance *instance)
 {
     char junk;
     unsigned port = 0;
     unsigned A[4];
     sockaddr_in inet_addr;
+    int backlog = listenBacklog;
+    std::string plainSpec(spec);
+    size_t suffix = plainSpec.rfind(",backlog=");
 
     memset(&inet_addr, 0, sizeof(inet_addr));
 
+    if(suffix!=plainSpec.npos) {
+        // optional ",backlog=<n>" overrides --backlog for this endpoint
+        if(sscanf(plainSpec.c_str()+suffix+9, "%d %c", &backlog, &junk)!=1 || backlog<=0) {
+            fprintf(stderr, "Invalid backlog in socket spec '%s'\n", spec);
+            exit(1);
+        }
+        plainSpec.erase(suffix);
+        spec = plainSpec.c_str();
+    }
+
     if(sscanf(spec, "%u %c", &port, &junk)==1) {
         // simple integer is TCP port number
         inet_addr.sin_family = AF_INET;
@@ -120,7 +181,8 @@ connectionItem * acceptFactory (const char *spec, bool local, bool readonly)
                      procservName, port );
             exit(1);
         }
-        connectionItem *ci = new acceptItemTCP(inet_addr, readonly);
+        connectionItem *ci = new acceptItemTCP(inet_addr, readonly, factory, backlog,
+                                               instance);
         return ci;
     } else if(sscanf(spec, "%u . %u . %u . %u : %u %c",
                      &A[0], &A[1], &A[2], &A[3], &port, &junk)==5) {
@@ -133,11 +195,13 @@ connectionItem * acceptFactory (const char *spec, bool local, bool readonly)
                      procservName, port );
             exit(1);
         }
-        connectionItem *ci = new acceptItemTCP(inet_addr, readonly);
+        connectionItem *ci = new acceptItemTCP(inet_addr, readonly, factory, backlog,
+                                               instance);
         return ci;
     } else if(strncmp(spec, "unix:", 5)==0) {
 #ifdef USOCKS
-        connectionItem *ci = new acceptItemUNIX(spec+5, readonly);
+        connectionItem *ci = new acceptItemUNIX(spec+5, readonly, factory, backlog,
+                                                instance);
         return ci;
 #else
         fprintf(stderr, "Unix sockets not supported on this host\n");
@@ -149,8 +213,23 @@ connectionItem * acceptFactory (const char *spec, bool local, bool readonly)
     }
 }
 
+void acceptItem::listenOn()
+{
+    // Accepting is done until EAGAIN
+    fcntl(_fd, F_SETFL, fcntl(_fd, F_GETFL) | O_NONBLOCK);
+    fcntl(_fd, F_SETFD, FD_CLOEXEC);
+
+    if (listen(_fd, backlog) < 0) {
+        PRINTF("Listen error: %s\n", strerror(errno));
+        throw errno;
+    }
+    PRINTF("Listen backlog is %d\n", backlog);
+}
+
 acceptItem::~acceptItem()
 {
+    std::vector<acceptItem *>::iterator it = std::find(paused.begin(), paused.end(), this);
+    if (it != paused.end()) paused.erase(it);
     if (_fd >= 0) close(_fd);
     PRINTF("~acceptItem()\n");
 }
@@ -159,8 +238,10 @@ acceptItem::~acceptItem()
 // Accept item constructor
 // This opens a socket, binds it to the decided port,
 // and sets it to listen mode
-acceptItemTCP::acceptItemTCP(const sockaddr_in &addr, bool readonly)
-    :acceptItem(readonly)
+acceptItemTCP::acceptItemTCP(const sockaddr_in &addr, bool readonly,
+                             connectionFactory factory, int backlog,
+                             childInstance *instance)
+    :acceptItem(readonly, factory, backlog, instance)
     ,addr(addr)
 {
     char myname[128] = "<unknown>\0";
@@ -213,10 +294,7 @@ void acceptItemTCP::remakeConnection()
     else
         PRINTF("Bind returned %d\n", bindStatus);
 
-    if (listen(_fd, 5) < 0) {
-        PRINTF("Listen error: %s\n", strerror(errno));
-        throw errno;
-    }
+    listenOn();
 
     socklen_t slen = sizeof(addr);
     getsockname(_fd, (struct sockaddr *) &addr, &slen);
@@ -226,8 +304,10 @@ void acceptItemTCP::remakeConnection()
 }
 
 #ifdef USOCKS
-acceptItemUNIX::acceptItemUNIX(const char *path, bool readonly)
-    :acceptItem(readonly)
+acceptItemUNIX::acceptItemUNIX(const char *path, bool readonly,
+                               connectionFactory factory, int backlog,
+                               childInstance *instance)
+    :acceptItem(readonly, factory, backlog, instance)
     ,uid(getuid())
     ,gid(getgid())
     ,perms(0666) // default permissions equivalent to tcp bind to localhost
@@ -360,10 +440,7 @@ void acceptItemUNIX::remakeConnection()
     else
         PRINTF("Bind returned %d\n", bindStatus);
 
-    if (listen(_fd, 5) < 0) {
-        PRINTF("Listen error: %s\n", strerror(errno));
-        throw errno;
-    }
+    listenOn();
 
     if(!abstract) {
         if(chmod(addr.sun_path, 0)<0)
@@ -382,21 +459,145 @@ void acceptItemUNIX::remakeConnection()
 
 #endif
 
-// Accept connection and create a new connectionItem for it.
+// Admission control
+// Connections over the limits (--max-clients, --max-loggers,
+// --max-per-source) are turned away before any client item is created.
+// Source of a connection: the peer's IP address (TCP) or uid (UNIX)
+static std::string sourceOf(int fd, const struct sockaddr_storage &addr)
+{
+    char buf[64] = "";
+
+    if (addr.ss_family == AF_INET) {
+        inet_ntop(AF_INET, &((const sockaddr_in &) addr).sin_addr, buf, sizeof(buf));
+        return buf;
+    }
+#if defined(USOCKS) && defined(SO_PEERCRED)
+    if (addr.ss_family == AF_UNIX) {
+        struct ucred cred;
+        socklen_t len = sizeof(cred);
+        if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) == 0) {
+            snprintf(buf, sizeof(buf), "uid:%lu", (unsigned long) cred.uid);
+            return buf;
+        }
+    }
+#endif
+    return "";
+}
+
+// The limits apply to the connections of each child instance
+// Returns the reason for turning the connection away, NULL to admit it
+static const char * admissionCheck(childInstance *instance, bool readonly,
+                                   const std::string &source)
+{
+    clientMetrics m;
+    int kind = 0, same = 0;
+    int max = readonly ? maxLoggers : maxClients;
+
+    if (!max && !maxPerSource) return NULL;
+    for (connectionItem *p = instance->members; p; p = p->memberNext) {
+        if (p->IsDead() || !p->getClientMetrics(m)) continue;
+        if (m.logger == readonly) kind++;
+        if (maxPerSource && !source.empty() && p->source == source) same++;
+    }
+    if (max && kind >= max) {
+        metrics.rejected[readonly]++;
+        return readonly ? "Too many log connections" : "Too many control connections";
+    }
+    if (maxPerSource && same >= maxPerSource) {
+        metrics.rejectedPerSource++;
+        return "Too many connections from your address";
+    }
+    return NULL;
+}
+
+// Accept pending connections (until EAGAIN, at most ACCEPT_BATCH)
+// and create a new connectionItem for each of them.
 void acceptItem::readFromFd(void)
 {
-    int newFd;
-    struct sockaddr addr;
-    socklen_t len = sizeof(addr);
-
-    newFd = accept( _fd, &addr, &len );
-    if (newFd >= 0) {
-        PRINTF("acceptItem: Accepted connection on handle %d\n", newFd);
-        AddConnection(clientFactory(newFd, _readonly));
-    } else {
-        PRINTF("Accept error: %s\n", strerror(errno)); // on Cygwin got error EINVAL
-        remakeConnection();
+    int newFd, n = 0;
+    struct sockaddr_storage addr;
+    socklen_t len;
+
+    metrics.acceptWakeups++;
+    while (n < ACCEPT_BATCH) {
+        len = sizeof(addr);
+#ifdef SOCK_NONBLOCK
+        newFd = accept4( _fd, (struct sockaddr *) &addr, &len, SOCK_NONBLOCK | SOCK_CLOEXEC );
+#else
+        newFd = accept( _fd, (struct sockaddr *) &addr, &len );
+        if (newFd >= 0) fcntl( newFd, F_SETFD, FD_CLOEXEC );
+#endif
+        if (newFd >= 0) {
+            n++;
+            PRINTF("acceptItem: Accepted connection on handle %d\n", newFd);
+            std::string source;
+            if (published()) {
+                source = sourceOf(newFd, addr);
+                const char *reason = admissionCheck(instance, _readonly, source);
+                if (reason) {
+                    char msg[80];
+                    int len = snprintf(msg, sizeof(msg), "@@@ %s, closing" NL, reason);
+                    PRINTF("acceptItem: Rejected connection from '%s': %s\n",
+                           source.c_str(), reason);
+                    ignore_result( write(newFd, msg, len) );
+                    close(newFd);
+                    continue;
+                }
+            }
+            connectionItem *ci = factory(newFd, _readonly, instance);
+            ci->source = source;
+            AddConnection(ci);
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            break;                      // All pending connections taken
+        } else if (errno == EINTR || errno == ECONNABORTED || errno == EPROTO) {
+            continue;                   // Try the next one
+        } else if (errno == EMFILE || errno == ENFILE
+                   || errno == ENOBUFS || errno == ENOMEM) {
+            PRINTF("Accept error: %s\n", strerror(errno));
+            metrics.acceptErrors++;
+            pauseAccept();              // Leave them pending, try again later
+            break;
+        } else {
+            PRINTF("Accept error: %s\n", strerror(errno)); // on Cygwin got error EINVAL
+            metrics.acceptErrors++;
+            int oldFd = _fd;
+            _fd = -1;
+            UpdateConnection(this);     // unwatch the old socket before closing it
+            close(oldFd);
+            remakeConnection();
+            UpdateConnection(this);
+            break;
+        }
+    }
+
+    if (n && _wantRead) retryMs = ACCEPT_RETRY_MIN;
+    metrics.acceptedConnections += n;
+    if (n == ACCEPT_BATCH) metrics.acceptBatchFull++;
+    if ((unsigned) n > metrics.acceptBatchMax) metrics.acceptBatchMax = n;
+}
+
+void acceptItem::pauseAccept()
+{
+    if (!_wantRead) return;
+    PRINTF("acceptItem: Pausing listener on handle %d for %ld ms\n", _fd, retryMs);
+    _wantRead = false;
+    if (watchedFd >= 0) UpdateConnection(this);
+    paused.push_back(this);
+    if (!acceptRetryTimer.armed()) {
+        acceptRetryTimer.armIn(retryMs);
+        retryMs = std::min(retryMs * 2, (long) ACCEPT_RETRY_MAX);
+    }
+}
+
+// Timer callback: listen again on the paused listeners
+void acceptItem::resumeAccept()
+{
+    for (size_t i = 0; i < paused.size(); i++) {
+        acceptItem *p = paused[i];
+        p->_wantRead = true;
+        if (p->watchedFd >= 0) UpdateConnection(p);
     }
+    paused.clear();
 }
 
 // Send characters to client
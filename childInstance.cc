@@ -0,0 +1,264 @@
+// Process server for soft ioc
+// Ralph Lange <ralph.lange@gmx.de> 2007-2019
+// GNU Public License (GPLv3) applies - see www.gnu.org
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <fstream>
+#include <set>
+
+#include "procServ.h"
+#include "childInstance.h"
+
+// Child instances
+// Single child mode runs one instance, set up from the command line.
+// Supervisor mode (--config) runs one instance per section of the
+// configuration file, each with its own pty, endpoints, log file and
+// restart policy. All of them share the server's event loop.
+
+childInstance * childInstance::head;
+int childInstance::count;
+
+childSettings::childSettings()
+    : childName(NULL), childExec(NULL), childArgv(NULL), command(NULL),
+      chDir(NULL), ignChars(NULL),
+      killChar(0x18), toggleRestartChar(0x14), restartChar(0x12),
+      quitChar(0x11), logoutChar(0x00),
+      killSig(SIGKILL), setCoreSize(false), coreSize(0),
+      holdoffTime(15), restartMode(restart), waitForManualStart(false),
+      logPort(NULL), logFile(NULL)
+{
+}
+
+childInstance::childInstance(const childSettings &settings)
+    : childSettings(settings),
+      firstRun(true), finished(false), process(NULL), childPid(0),
+      restartTime(0), restartTimer(processFactoryRecheck), IOCStart(0),
+      members(NULL), inputPaused(false), users(0), loggers(0),
+      bannerGeneration(1), infoMessage3Chunk(NULL),
+      logFileFD(-1), logCur(NULL), logDropped(0), logWriterFd(-1),
+      logUnsynced(0), logSize(0), logRotateAt(0), logMidLine(false), logZ(NULL),
+      logRotations(0),
+      logLineStart(true),
+      ringBuf(NULL), ringHead(0), ringUsed(0), next(NULL)
+{
+    childInstance **pi;
+
+    banner[0] = banner[1] = NULL;
+    bannerBuilt[0] = bannerBuilt[1] = 0;
+    memset(&logLastSync, 0, sizeof(logLastSync));
+    memset(&counters, 0, sizeof(counters));
+    infoMessage1[0] = infoMessage2[0] = '\0';
+
+    // Single command characters should be ignored, too
+    // (into a copy: the settings may be shared with other instances)
+    if (ignChars || killChar || toggleRestartChar || logoutChar) {
+        const char *ign = ignChars ? ignChars : "";
+        ignChars = (char*) calloc(strlen(ign) + 4, 1);
+        strcpy(ignChars, ign);
+        if (killChar)
+            strncat (ignChars, &killChar, 1);
+        if (toggleRestartChar)
+            strncat (ignChars, &toggleRestartChar, 1);
+        if (logoutChar)
+            strncat (ignChars, &logoutChar, 1);
+    }
+
+    // Set up available server commands message
+    size_t len = snprintf(infoMessage3, INFO3LEN,
+                          "@@@ %s%c or %s%c restarts the child",
+                          CTL_SC(restartChar), CTL_SC(killChar));
+    if (quitChar && len < INFO3LEN)
+        len += snprintf(infoMessage3 + len, INFO3LEN - len, ", %s%c quits the server",
+                        CTL_SC(quitChar));
+    if (logoutChar && len < INFO3LEN)
+        len += snprintf(infoMessage3 + len, INFO3LEN - len, ", %s%c closes this connection",
+                        CTL_SC(logoutChar));
+    if (len < INFO3LEN)
+        snprintf(infoMessage3 + len, INFO3LEN - len, NL);
+
+    // Keep the order of creation (config file order)
+    for (pi = &head; *pi; pi = &(*pi)->next);
+    *pi = this;
+    count++;
+}
+
+// Split a command line into words
+// Words are separated by blanks, '...' and "..." quote, \ escapes
+// (not within '...'). Returns false if a quote is not closed.
+static bool splitCommand(const std::string &line, std::vector<std::string> &words)
+{
+    std::string word;
+    bool inWord = false;
+    char quote = 0;
+
+    for (size_t i = 0; i < line.size(); i++) {
+        char c = line[i];
+        if (quote) {
+            if (c == quote) quote = 0;
+            else if (c == '\\' && quote == '"' && i + 1 < line.size()) word += line[++i];
+            else word += c;
+        } else if (c == ' ' || c == '\t') {
+            if (inWord) words.push_back(word);
+            word.clear();
+            inWord = false;
+        } else {
+            inWord = true;
+            if (c == '\'' || c == '"') quote = c;
+            else if (c == '\\' && i + 1 < line.size()) word += line[++i];
+            else word += c;
+        }
+    }
+    if (inWord) words.push_back(word);
+    return quote == 0;
+}
+
+static std::string trim(const std::string &s)
+{
+    size_t b = s.find_first_not_of(" \t\r\n");
+    size_t e = s.find_last_not_of(" \t\r\n");
+    return b == std::string::npos ? "" : s.substr(b, e - b + 1);
+}
+
+// Apply one "key = value" line of a section
+// Returns the reason if it is not valid, NULL if it is
+static const char * configSetting(childSettings &s, const std::string &key,
+                                  const std::string &value, bool hasValue)
+{
+    const char *v = value.c_str();
+    long l;
+
+    // Flags
+    if (key == "noautorestart" || key == "oneshot" || key == "wait") {
+        if (hasValue) return "does not take a value";
+        if (key == "noautorestart") s.restartMode = norestart;
+        else if (key == "oneshot") s.restartMode = oneshot;
+        else s.waitForManualStart = true;
+        return NULL;
+    }
+
+    if (!hasValue) return "needs a value";
+    if (key == "port") {
+        s.ctlSpecs.push_back(value);
+    } else if (key == "logport") {
+        s.logPort = strdup(v);
+    } else if (key == "logfile") {
+        s.logFile = strdup(v);
+    } else if (key == "chdir") {
+        s.chDir = strdup(v);
+    } else if (key == "exec") {
+        s.childExec = strdup(v);
+    } else if (key == "command") {
+        std::vector<std::string> words;
+        if (!splitCommand(value, words)) return "has an unterminated quote";
+        if (words.empty()) return "is empty";
+        s.childArgv = (char**) calloc(words.size() + 1, sizeof(char*));
+        for (size_t i = 0; i < words.size(); i++)
+            s.childArgv[i] = strdup(words[i].c_str());
+        s.command = s.childArgv[0];
+    } else if (key == "holdoff") {
+        l = atol(v);
+        if (l < 0) return "must not be negative";
+        s.holdoffTime = l;
+    } else if (key == "ignore") {
+        s.ignChars = getIgnoreChars(v);
+    } else if (key == "killcmd") {
+        s.killChar = getOptionChar(v);
+    } else if (key == "autorestartcmd") {
+        s.toggleRestartChar = getOptionChar(v);
+    } else if (key == "logoutcmd") {
+        s.logoutChar = getOptionChar(v);
+    } else if (key == "killsig") {
+        l = abs(atoi(v));
+        if (l >= 32) return "is not a valid signal (>31)";
+        s.killSig = l;
+    } else if (key == "coresize") {
+        l = atol(v);
+        if (l < 0) return "must not be negative";
+        s.coreSize = l;
+        s.setCoreSize = true;
+    } else {
+        return "is unknown";
+    }
+    return NULL;
+}
+
+// Parse a --config file
+// Every "[name]" line starts the section of a child, followed by
+// "key = value" lines (see procServ.md). The command line options are
+// the defaults for all sections. No instance is created unless the
+// whole file is valid.
+bool readConfigFile(const char *file, const childSettings &defaults)
+{
+    std::ifstream in(file);
+    std::vector<childSettings> sections;
+    std::set<std::string> names;
+    std::string line;
+    int lineNo = 0;
+
+    if (!in) {
+        fprintf(stderr, "%s: unable to open config file %s\n", procservName, file);
+        return false;
+    }
+
+    while (std::getline(in, line)) {
+        lineNo++;
+        line = trim(line);
+        if (line.empty() || line[0] == '#' || line[0] == ';') continue;
+
+        if (line[0] == '[') {
+            std::string name = trim(line.substr(1, line.size() - 2));
+            if (line[line.size()-1] != ']' || name.empty()) {
+                fprintf(stderr, "%s: %s:%d: invalid section header\n",
+                        procservName, file, lineNo);
+                return false;
+            }
+            if (!names.insert(name).second) {
+                fprintf(stderr, "%s: %s:%d: duplicate child name '%s'\n",
+                        procservName, file, lineNo, name.c_str());
+                return false;
+            }
+            sections.push_back(defaults);
+            sections.back().childName = strdup(name.c_str());
+            // Quitting from one console would take down all children
+            sections.back().quitChar = 0;
+            continue;
+        }
+
+        size_t eq = line.find('=');
+        std::string key = trim(line.substr(0, eq));
+        std::string value = eq == std::string::npos ? "" : trim(line.substr(eq + 1));
+        if (sections.empty()) {
+            fprintf(stderr, "%s: %s:%d: '%s' outside of a [child] section\n",
+                    procservName, file, lineNo, key.c_str());
+            return false;
+        }
+        const char *error = configSetting(sections.back(), key, value,
+                                          eq != std::string::npos);
+        if (error) {
+            fprintf(stderr, "%s: %s:%d: '%s' %s\n",
+                    procservName, file, lineNo, key.c_str(), error);
+            return false;
+        }
+    }
+
+    if (sections.empty()) {
+        fprintf(stderr, "%s: %s: no children configured\n", procservName, file);
+        return false;
+    }
+    for (size_t i = 0; i < sections.size(); i++) {
+        if (!sections[i].command) {
+            fprintf(stderr, "%s: %s: child '%s' has no command\n",
+                    procservName, file, sections[i].childName);
+            return false;
+        }
+    }
+
+    for (size_t i = 0; i < sections.size(); i++) {
+        if (!sections[i].childExec) sections[i].childExec = sections[i].command;
+        new childInstance(sections[i]);
+    }
+    return true;
+}
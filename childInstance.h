@@ -0,0 +1,119 @@
+// Process server for soft ioc
+// Ralph Lange <ralph.lange@gmx.de> 2007-2019
+// GNU Public License (GPLv3) applies - see www.gnu.org
+
+
+#ifndef childInstanceH
+#define childInstanceH
+
+#include <string>
+#include <vector>
+
+#include "procServ.h"
+#include "eventLoop.h"
+#include "metrics.h"
+
+class processClass;
+class outputChunk;
+
+// Settings of a child
+// Taken from the command line, or from a section of the --config file
+// (a section starts with a copy of the command line settings)
+struct childSettings
+{
+    childSettings();
+
+    char   *childName;               // The name of that beast (child)
+    char   *childExec;               // Exec to run as child
+    char   **childArgv;              // Argv for child process
+    char   *command;                 // Command the child was started as
+    char   *chDir;                   // Directory to change to before starting child
+    char   *ignChars;                // Characters to ignore
+    char   killChar;                 // Kill command character (default: ^X)
+    char   toggleRestartChar;        // Toggle autorestart character (default: ^T)
+    char   restartChar;              // Restart character (default: ^R)
+    char   quitChar;                 // Quit character (default: ^Q)
+    char   logoutChar;               // Logout client connection character (default: none)
+    int    killSig;                  // Kill signal (default: SIGKILL)
+    bool   setCoreSize;              // Set core size for child
+    rlim_t coreSize;                 // Max core size for child
+    time_t holdoffTime;              // Holdoff time between child restarts (in seconds)
+    RestartMode restartMode;         // Child restart mode (restart/norestart/oneshot)
+    bool   waitForManualStart;       // Waits for telnet cmd to manually start child
+    std::vector<std::string> ctlSpecs;  // Endpoints for control connections
+    char   *logPort;                 // Endpoint for logger connections
+    char   *logFile;                 // File name for log
+};
+
+// childInstance class definition
+// Everything that belongs to one child: its settings, the running
+// process, the connections on its party line, its log file and its
+// scrollback. procServ runs one instance (command line) or one per
+// section of the --config file (supervisor mode), all on one event loop.
+class childInstance : public childSettings
+{
+public:
+    childInstance(const childSettings &settings);
+
+    // Child
+    bool   firstRun;                 // Has process run for purposes of oneshot restart mode
+    bool   finished;                 // Oneshot child has exited, not to be started again
+    processClass *process;           // Set while the child is running
+    pid_t  childPid;                 // Child to be reaped (0: none)
+    time_t restartTime;              // Don't start a new child before this time
+    eventTimer restartTimer;         // Wakes up the main loop when the holdoff time is over
+    time_t IOCStart;                 // Time when the current child was started
+    std::string envInfo;             // PROCSERV_INFO for the child
+    childMetrics counters;           // This child's share of the metrics
+
+    // Sign on messages (infoMessage3 is set up by the constructor)
+    char   infoMessage1[INFO1LEN];   // Server PID, child pwd and command line
+    char   infoMessage2[INFO2LEN];   // Child PID
+    char   infoMessage3[INFO3LEN];   // Available server commands
+
+    // Connections of this instance (the party line)
+    connectionItem *members;
+    bool   inputPaused;              // Connections are waiting for resumeInput()
+    int    users;                    // Connected clients
+    int    loggers;
+    unsigned long bannerGeneration;  // Incremented by bannerChanged()
+    outputChunk *banner[2];          // Cached banners [user, logger]
+    unsigned long bannerBuilt[2];    // bannerGeneration they were made for
+    outputChunk *infoMessage3Chunk;  // infoMessage3 is set once
+
+    // Log file (see logFile.cc)
+    int    logFileFD;                // FD for log file
+    struct logBlock *logCur;         // Block being filled (queued for the writer)
+    size_t logDropped;               // Bytes dropped since the last marker (--log-overflow drop)
+    int    logWriterFd;              // FD written to last (writer thread)
+    size_t logUnsynced;              // Bytes written since last fsync() (writer thread)
+    struct timespec logLastSync;     // (writer thread)
+    unsigned long long logSize;      // Size of the current log file (writer thread)
+    time_t logRotateAt;              // Next time based rotation (writer thread)
+    bool   logMidLine;               // Last write did not end a line (writer thread)
+    struct logFrame *logZ;           // Compression state (--log-gzip, writer thread)
+    unsigned long logRotations;      // Rotations so far (see logRotate.cc)
+    bool   logLineStart;             // Next output starts a line (--logstamp)
+
+    // Scrollback (see scrollback.cc)
+    char  *ringBuf;                  // Allocated on first use
+    size_t ringHead;                 // Next byte to write
+    size_t ringUsed;                 // Bytes in the ring
+
+    childInstance *next;
+    static childInstance *head;
+    static int count;
+
+private:
+    // This should never happen
+    childInstance(const childInstance &)
+    {
+        assert(0);
+    };
+};
+
+// Creates the instances for the sections of a --config file
+// Returns false (after printing the reason) if the file is not valid
+bool readConfigFile(const char *file, const childSettings &defaults);
+
+#endif /* #ifndef childInstanceH */
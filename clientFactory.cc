@@ -13,15 +13,15 @@
 #include <arpa/inet.h>
 #include <string.h>
 #include <signal.h>
+#include <fcntl.h>
 
 #include "procServ.h"
+#include "childInstance.h"
 #include "processClass.h"
+#include "outputQueue.h"
+#include "metrics.h"
 #include "libtelnet.h"
 
-// Wrapper to ignore return values
-template<typename T>
-inline void ignore_result(T /* unused result */) {}
-
 static const telnet_telopt_t my_telopts[] = {
   { TELNET_TELOPT_ECHO,      TELNET_WILL,           0 },
   { TELNET_TELOPT_LINEMODE,            0, TELNET_DO   },
@@ -29,7 +29,44 @@ static const telnet_telopt_t my_telopts[] = {
   { -1, 0, 0 }
 };
 
-const char *restartModeString()
+// Max. amount of output (bytes) queued for a client that does not keep up
+#define CLIENT_QUEUE_SIZE (256*1024)
+
+size_t clientQueueSize = CLIENT_QUEUE_SIZE;
+// [user, logger]: users lose nothing unless configured so
+OverflowPolicy overflowPolicy[2] = { overflowBlock, overflowDrop };
+
+// Parse the --user-overflow / --logger-overflow argument
+// Returns false if the argument is not valid (loggers must not block)
+bool parseOverflowPolicy(const char *arg, bool logger)
+{
+    if (strcmp(arg, "disconnect") == 0) {
+        overflowPolicy[logger] = overflowDisconnect;
+    } else if (strcmp(arg, "drop") == 0) {
+        overflowPolicy[logger] = overflowDrop;
+    } else if (strcmp(arg, "block") == 0 && !logger) {
+        overflowPolicy[logger] = overflowBlock;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// Parse the --client-queue argument (bytes, k and M suffixes allowed)
+// Returns false if the argument is not valid
+bool parseClientQueueSize(const char *arg)
+{
+    char *end;
+    long n = strtol(arg, &end, 10);
+
+    if (*end == 'k' || *end == 'K') { n *= 1024; end++; }
+    else if (*end == 'M') { n *= 1024*1024; end++; }
+    if (end == arg || *end || n <= 0) return false;
+    clientQueueSize = n;
+    return true;
+}
+
+const char *restartModeString(RestartMode restartMode)
 {
     switch (restartMode) {
     case restart:   return "ON";
@@ -42,29 +79,41 @@ const char *restartModeString()
 class clientItem : public connectionItem
 {
 public:
-    clientItem(int port, bool readonly);
+    clientItem(int port, bool readonly, childInstance *instance);
     ~clientItem();
 
     void readFromFd(void);
+    void flushToFd(void);
     int Send(const char *buf, int len);
-    int Send(const char * stamp, int stamp_len,
-             const char * message, int count);
+    int Send(sharedOutput &out);
+    bool getClientMetrics(clientMetrics &m) const;
+    bool stayPaused() const { return !_readonly && processClass::inputFull(instance); }
+    bool blocksOutput() const { return _blocking; }
 
 private:
     static void telnet_eh(telnet_t *telnet, telnet_event_t *event, void *user_data);
     void processInput(const char *buf, int len);
+    int writeNow(const char *buf, int len);
     void writeToFd(const char *buf, int len);
+    void writeChunks(outputChunk *const *chunks, int n, outputChunk *extra = NULL);
+    void writeChunk(outputChunk *chunk) { writeChunks(&chunk, 1); }
+    void overflow(outputChunk *chunk);
+    outputChunk * banner(bool readonly);
 
     telnet_t *_telnet;
-    static int _users;
-    static int _loggers;
+    outputQueue _queue;      // Output waiting for the socket to become writable
+    OverflowPolicy _policy;  // What to do when _queue is full
+    bool _blocking;          // Holding the child's output until _queue drained
+    int _fdFlags;            // Original file status flags of the socket
+    clientMetrics _metrics;
+    static unsigned long _connections;
     static int _status;
 };
 
 // service and calls clientFactory when clients are accepted
-connectionItem * clientFactory(int socketIn, bool readonly)
+connectionItem * clientFactory(int socketIn, bool readonly, childInstance *instance)
 {
-    connectionItem *ci = new clientItem(socketIn, readonly);
+    connectionItem *ci = new clientItem(socketIn, readonly, instance);
     PRINTF("Created new client connection (clientItem %p; read%s)\n",
            ci, readonly?"only":"/write");
     return ci;
@@ -73,24 +122,34 @@ connectionItem * clientFactory(int socketIn, bool readonly)
 clientItem::~clientItem()
 {
     if (_fd >= 0) {
+        _queue.flush(_fd);      // Last chance, don't wait
+        if (_fdFlags != -1) fcntl(_fd, F_SETFL, _fdFlags);
         shutdown(_fd, SHUT_RDWR);
         close(_fd);
     }
     if (_telnet) telnet_free(_telnet);
+    if (_blocking) {
+        _blocking = false;
+        connectionItem::resumeInput(instance);
+    }
     PRINTF("~clientItem(); handle %d closed\n", _fd);
-    if (_readonly) _loggers--;
-    else _users--;
+    if (_readonly) instance->loggers--;
+    else instance->users--;
+    metrics.closed[_readonly]++;
 }
 
-// Client item constructor
-// This sets KEEPALIVE on the socket and displays the greeting
-// Also sets the socket SNDTIMEO
-clientItem::clientItem(int socketIn, bool readonly) :
-    connectionItem(socketIn, readonly)
+// Connection greeting
+// The parts that do not depend on the number of connected clients are
+// formatted once (per instance) and kept as chunks until bannerChanged()
+// is called (child started or shut down, restart mode toggled).
+void bannerChanged(childInstance *instance)
+{
+    instance->bannerGeneration++;
+}
+
+// Banner for users [0] or loggers [1]: welcome, commands, child info
+outputChunk * clientItem::banner(bool readonly)
 {
-    assert(socketIn>=0);
-    int optval = 1;
-    int i;
     struct tm procServStart_tm; // Time when this procServ started
     char procServStart_buf[32]; // Time when this procServ started - as string
     struct tm IOCStart_tm;      // Time when the current IOC was started
@@ -100,26 +159,29 @@ clientItem::clientItem(int socketIn, bool readonly) :
     char greeting1[] = "@@@ Welcome to procServ (" PROCSERV_VERSION_STRING ")" NL;
 #define GREETLEN 256
     char greeting2[GREETLEN] = "";
-    struct timeval send_timeout;
-    send_timeout.tv_sec = 10;
-    send_timeout.tv_usec = 0;
 
-    PRINTF("New clientItem %p\n", this);
-    if ( killChar ) {
-        snprintf(greeting2, GREETLEN, "@@@ Use %s%c to kill the child, ", CTL_SC(killChar));
+    childInstance *in = instance;
+    outputChunk *&cached = in->banner[readonly];
+
+    if ( cached && in->bannerBuilt[readonly] == in->bannerGeneration )
+        return cached;
+
+    PRINTF("Formatting the %s banner\n", readonly ? "logger" : "user");
+    if ( in->killChar ) {
+        snprintf(greeting2, GREETLEN, "@@@ Use %s%c to kill the child, ", CTL_SC(in->killChar));
     } else {
         snprintf(greeting2, GREETLEN, "@@@ Kill command disabled, ");
     }
-    snprintf(buf1, BUFLEN, "auto restart mode is %s, ", restartModeString());
-    if ( toggleRestartChar ) {
-        snprintf(buf2, BUFLEN, "use %s%c to toggle auto restart" NL, CTL_SC(toggleRestartChar));
+    snprintf(buf1, BUFLEN, "auto restart mode is %s, ", restartModeString(in->restartMode));
+    if ( in->toggleRestartChar ) {
+        snprintf(buf2, BUFLEN, "use %s%c to toggle auto restart" NL, CTL_SC(in->toggleRestartChar));
     } else {
         snprintf(buf2, BUFLEN, "auto restart toggle disabled" NL);
     }
     strncat(greeting2, buf1, GREETLEN-strlen(greeting2)-1);
     strncat(greeting2, buf2, GREETLEN-strlen(greeting2)-1);
-    if (logoutChar) {
-        snprintf(buf2, BUFLEN, "@@@ Use %s%c to logout from procServ server" NL, CTL_SC(logoutChar));
+    if (in->logoutChar) {
+        snprintf(buf2, BUFLEN, "@@@ Use %s%c to logout from procServ server" NL, CTL_SC(in->logoutChar));
         strncat(greeting2, buf2, GREETLEN-strlen(greeting2)-1);
     }
 
@@ -127,40 +189,90 @@ clientItem::clientItem(int socketIn, bool readonly) :
     strftime( procServStart_buf, sizeof(procServStart_buf)-1,
               timeFormat, &procServStart_tm );
 
-    localtime_r( &IOCStart, &IOCStart_tm );
+    localtime_r( &in->IOCStart, &IOCStart_tm );
     strftime( IOCStart_buf, sizeof(IOCStart_buf)-1,
               timeFormat, &IOCStart_tm );
 
     snprintf(buf1, BUFLEN, "@@@ procServ server started at: %s" NL,
              procServStart_buf);
 
-    if ( processClass::exists() ) {
+    if ( in->process ) {
         snprintf(buf2, BUFLEN, "@@@ Child \"%s\" started at: %s" NL,
-                 childName, IOCStart_buf );
+                 in->childName, IOCStart_buf );
         strncat(buf1, buf2, BUFLEN-strlen(buf1)-1);
     }
 
-    snprintf(buf2, BUFLEN, "@@@ %d user(s) and %d logger(s) connected (plus you)" NL,
-             _users, _loggers);
+    if ( cached ) cached->unref();
+    outputChunk *c = cached = outputChunk::create(
+        strlen(greeting1) + strlen(greeting2) + strlen(in->infoMessage1)
+        + strlen(in->infoMessage2) + strlen(buf1));
+    if ( ! readonly ) {
+        c->append(greeting1, strlen(greeting1));
+        c->append(greeting2, strlen(greeting2));
+    }
+    c->append(in->infoMessage1, strlen(in->infoMessage1));
+    c->append(in->infoMessage2, strlen(in->infoMessage2));
+    c->append(buf1, strlen(buf1));
+    in->bannerBuilt[readonly] = in->bannerGeneration;
+    return c;
+}
+
+// Client item constructor
+// This sets KEEPALIVE on the socket and displays the greeting
+// (followed by the scrollback, if enabled) using a single writev()
+// Also makes the socket non-blocking: output that can not be written
+// right away is queued (up to --client-queue, the scrollback replay
+// is queued on top of that)
+clientItem::clientItem(int socketIn, bool readonly, childInstance *instance) :
+    connectionItem(socketIn, readonly, instance),
+    _queue(clientQueueSize),
+    _policy(overflowPolicy[readonly]),
+    _blocking(false)
+{
+    assert(socketIn>=0);
+    int optval = 1;
+    int i, n = 0;
+    char buf[BUFLEN];
+    outputChunk *greeting[4];
+
+    PRINTF("New clientItem %p\n", this);
 
     setsockopt( socketIn, SOL_SOCKET, SO_KEEPALIVE, &optval, sizeof(optval) );
-    setsockopt( socketIn, SOL_SOCKET, SO_SNDTIMEO, &send_timeout, sizeof(send_timeout) );
-
-    if ( _readonly ) {          // Logging client
-        _loggers++;
-    } else {                    // Regular (user) client
-        _users++;
-        ignore_result( write(_fd, greeting1, strlen(greeting1)) );
-        ignore_result( write(_fd, greeting2, strlen(greeting2)) );
+    _fdFlags = fcntl( socketIn, F_GETFL );
+    if ( _fdFlags != -1 )
+        fcntl( socketIn, F_SETFL, _fdFlags | O_NONBLOCK );
+
+    memset( &_metrics, 0, sizeof(_metrics) );
+    _metrics.id = ++_connections;
+    _metrics.logger = _readonly;
+    metrics.accepted[_readonly]++;
+
+    greeting[n] = banner(_readonly);
+    greeting[n++]->ref();
+    if ( ! _readonly ) {
+        snprintf(buf, BUFLEN, "@@@ %d user(s) and %d logger(s) connected (plus you)" NL,
+                 instance->users, instance->loggers);
+        greeting[n++] = outputChunk::create(buf, strlen(buf));
+    }
+    if ( ! instance->process ) {
+        if ( ! instance->infoMessage3Chunk )
+            instance->infoMessage3Chunk = outputChunk::create(instance->infoMessage3,
+                                                              strlen(instance->infoMessage3));
+        greeting[n] = instance->infoMessage3Chunk;
+        greeting[n++]->ref();
     }
+    outputChunk *replay = scrollbackReplay(instance, _readonly);
+    if ( replay ) {
+        // Output continues where the scrollback left off
+        _log_stamp_sent = replay->data()[replay->size()-1] != '\n';
+    }
+
+    if ( _readonly ) instance->loggers++;   // Logging client
+    else instance->users++;                 // Regular (user) client
 
-    ignore_result( write(_fd, infoMessage1, strlen(infoMessage1)) );
-    ignore_result( write( _fd, infoMessage2, strlen(infoMessage2)) );
-    ignore_result( write( _fd, buf1, strlen(buf1)) );
-    if ( ! _readonly )
-        ignore_result( write(_fd, buf2, strlen(buf2)) );
-    if ( ! processClass::exists() )
-        ignore_result( write(_fd, infoMessage3, strlen(infoMessage3)) );
+    writeChunks(greeting, n, replay);
+    for ( i = 0; i < n; i++ ) greeting[i]->unref();
+    if ( replay ) replay->unref();
 
     _telnet = telnet_init(my_telopts, telnet_eh, 0, this);
 
@@ -185,13 +297,18 @@ void clientItem::readFromFd(void)
 
     if (len == 0) {
         PRINTF("clientItem:: Got EOF reading input connection\n");
-        _markedForDeletion = true;
+        markDead();
     } else if (len < 0) {
         PRINTF("clientItem:: Got error reading input connection: %s\n", strerror(errno));
-        _markedForDeletion = true;
+        markDead();
     } else if (!_readonly) {
         buf[len] = '\0';
         telnet_recv(_telnet, buf, len);
+        // Backpressure: stop reading while the child does not keep up
+        if (processClass::inputFull(instance) && wantsRead()) {
+            metrics.inputPauses++;
+            pauseInput();
+        }
     }
 }
 
@@ -201,43 +318,52 @@ void clientItem::readFromFd(void)
 void clientItem::processInput(const char *buf, int len)
 {
     int i;
+    childInstance *in = instance;
     if (len > 0) {
         // Scan input for commands
         for (i = 0; i < len; i++) {
-            if (false == processClass::exists()) {  // We're in child shut down mode
-                if ((restartChar && buf[i] == restartChar)
-                        || (killChar && buf[i] == killChar)) {
+            if (NULL == in->process) {              // We're in child shut down mode
+                if ((in->restartChar && buf[i] == in->restartChar)
+                        || (in->killChar && buf[i] == in->killChar)) {
                     PRINTF ("Got a restart command\n");
-                    waitForManualStart = false;
-                    processClass::restartOnce();
+                    in->waitForManualStart = false;
+                    if (in->finished) {     // Oneshot child may run once more
+                        in->finished = false;
+                        in->firstRun = true;
+                    }
+                    processClass::restartOnce(in);
                 }
-                if (quitChar && buf[i] == quitChar) {
+                if (in->quitChar && buf[i] == in->quitChar) {
                     PRINTF ("Got a shutdown command\n");
                     shutdownServer = true;
                 }
             }
-            if (logoutChar && buf[i] == logoutChar) {
+            if (in->logoutChar && buf[i] == in->logoutChar) {
                 PRINTF ("Got a logout command\n");
-                _markedForDeletion = true;
+                markDead();
             }
-            if (toggleRestartChar && buf[i] == toggleRestartChar) {
-                if (restartMode == restart) restartMode = norestart;
-                else if (restartMode == norestart) {
-                    restartMode = oneshot;
-                    firstRun    = true;	// Allow process to run once AFTER selecting oneshot
+            if (in->toggleRestartChar && buf[i] == in->toggleRestartChar) {
+                if (in->restartMode == restart) in->restartMode = norestart;
+                else if (in->restartMode == norestart) {
+                    in->restartMode = oneshot;
+                    in->firstRun    = true;	// Allow process to run once AFTER selecting oneshot
                 }
-                else restartMode = restart;
+                else in->restartMode = restart;
+                in->finished = false;
+                bannerChanged(in);
+                processFactoryRecheck();
                 char msg[128] = NL;
                 PRINTF ("Got a toggleAutoRestart command\n");
-                SendToAll(msg, strlen(msg), NULL);
-                snprintf(msg, 128, "@@@ Toggled auto restart mode to %s" NL, restartModeString());
-                SendToAll(msg, strlen(msg), NULL);
+                SendToAll(msg, strlen(msg), NULL, in);
+                snprintf(msg, 128, "@@@ Toggled auto restart mode to %s" NL,
+                         restartModeString(in->restartMode));
+                SendToAll(msg, strlen(msg), NULL, in);
             }
-            if (killChar && buf[i] == killChar) {
+            if (in->killChar && buf[i] == in->killChar) {
                 const char *msg = NL "@@@ Got a kill command" NL;
                 PRINTF ("Got a kill command\n");
-                SendToAll(msg, strlen(msg), NULL);
-                processFactorySendSignal(killSig);
+                SendToAll(msg, strlen(msg), NULL, in);
+                processFactorySendSignal(in, in->killSig);
             }
         }
         SendToAll(buf, len, this);
@@ -254,40 +380,150 @@ int clientItem::Send(const char * buf, int len)
     return _status;
 }
 
-// Send characters, printing time stamps at every new line
-int clientItem::Send(const char * stamp, int stamp_len,
-                     const char * message, int count)
+// Send party line output, printing time stamps at every new line
+// (loggers only)
+// The encoded output is shared with all other clients of the same kind
+int clientItem::Send(sharedOutput &out)
 {
-    if (isLogger()) {
+    if (_markedForDeletion || out.count <= 0) return 0;
+    _status = 0;
+    if (isLogger() && out.stamp) {
         // Some OSs (Windows) do not support line buffering, so we can get parts of lines,
         // hence need to track of when to send timestamp
-        int i = 0, j = 0;
-        for (i = 0; i < count; ++i) {
-            if (!_log_stamp_sent) {
-                Send(stamp, stamp_len);
-                _log_stamp_sent = true;
-            }
-            if (message[i] == '\n') {
-                Send(message+j, i-j+1);
-                j = i + 1;
-                _log_stamp_sent = false;
-            }
-        }
-        return Send(message+j, count-j);  // finish off rest of line with no newline at end
+        outputChunk *chunks[2] = { out.stampChunk(), out.stamped() };
+        if (_log_stamp_sent) writeChunks(chunks + 1, 1);
+        else writeChunks(chunks, 2);     // Stamp and lines in one writev()
+        _log_stamp_sent = !out.endsLine();
     } else {
-        return Send(message, count);
+        writeChunk(out.plain());
     }
+    return _status;
 }
 
-// Write characters to client FD
-void clientItem::writeToFd(const char * buf, int len)
+// Write characters to client FD right away (if nothing is queued)
+// Returns the number of bytes written, -1 if the connection failed
+int clientItem::writeNow(const char * buf, int len)
 {
     int status = 0;
+    if (!_queue.empty()) return 0;
+
     while (-1 == (status = write(_fd, buf, len)) && errno == EINTR);
+    _metrics.writes++;
+    metrics.clientWrites++;
+    if (status > 0) {
+        _metrics.bytesSent += status;
+        metrics.clientBytesSent += status;
+    }
     if (-1 == status) {
-        _markedForDeletion = true;
+        if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+        markDead();
         _status = status;
     }
+    return status;
+}
+
+// Write characters to client FD
+// Never blocks: whatever the socket does not take right away is queued
+void clientItem::writeToFd(const char * buf, int len)
+{
+    int status;
+    if (_markedForDeletion || len <= 0) return;
+
+    if ((status = writeNow(buf, len)) < 0 || status == len) return;
+
+    if (!_queue.push(buf + status, len - status)) {
+        outputChunk *chunk = outputChunk::create(buf + status, len - status);
+        overflow(chunk);
+        chunk->unref();
+        if (_markedForDeletion) return;
+    }
+    setWantWrite(true);
+}
+
+// Write shared chunks to client FD
+// Queues references to the chunks instead of copies of the data,
+// if nothing was queued before, they go out right away in one writev()
+// An extra chunk (the scrollback replay) follows them outside the limit
+void clientItem::writeChunks(outputChunk *const *chunks, int n, outputChunk *extra)
+{
+    bool wasEmpty = _queue.empty();
+    if (_markedForDeletion) return;
+
+    for (int i = 0; i < n; i++) {
+        if (!_queue.push(chunks[i])) {
+            overflow(chunks[i]);
+            if (_markedForDeletion) return;
+        }
+    }
+    if (extra) _queue.pushExtra(extra);
+    if (_queue.empty()) return;
+    if (wasEmpty) flushToFd();
+    if (!_queue.empty()) setWantWrite(true);
+}
+
+// Output queue is full: the client does not keep up
+// The overflow policy for its kind (--user-overflow, --logger-overflow)
+// decides what happens to the chunk that does not fit
+void clientItem::overflow(outputChunk *chunk)
+{
+    size_t dropped;
+
+    _metrics.overflows++;
+    metrics.clientOverflows++;
+    switch (_policy) {
+    case overflowBlock:         // Lossless: hold the child's output instead
+        _queue.push(chunk, 0, true);
+        if (!_blocking) {
+            PRINTF("clientItem: output queue full (%lu bytes queued) - holding child output\n",
+                   (unsigned long) _queue.bytes());
+            _blocking = true;
+            metrics.clientBlocks++;
+            processClass::holdOutput(instance);
+        }
+        break;
+    case overflowDrop:          // Drop the oldest output, leave a marker
+        dropped = _queue.pushDropOldest(chunk);
+        PRINTF("clientItem: output queue full - dropped %lu bytes\n",
+               (unsigned long) dropped);
+        _metrics.bytesDropped += dropped;
+        metrics.clientBytesDropped += dropped;
+        instance->counters.clientBytesDropped += dropped;
+        break;
+    case overflowDisconnect:    // Rather than stalling everybody else
+        PRINTF("clientItem: output queue full (%lu bytes queued, %lu more) - disconnecting\n",
+               (unsigned long) _queue.bytes(), (unsigned long) chunk->size());
+        _metrics.bytesDropped += _queue.bytes() + chunk->size();
+        metrics.clientBytesDropped += _queue.bytes() + chunk->size();
+        instance->counters.clientBytesDropped += _queue.bytes() + chunk->size();
+        _queue.clear();
+        setWantWrite(false);
+        markDead();
+        break;
+    }
+}
+
+// clientItem::flushToFd
+// Socket is writable: send queued output
+void clientItem::flushToFd(void)
+{
+    int status = _queue.flush(_fd);
+    _metrics.writes++;
+    metrics.clientWrites++;
+    if (status > 0) {
+        _metrics.bytesSent += status;
+        metrics.clientBytesSent += status;
+    }
+    if (status < 0) {
+        PRINTF("clientItem:: Got error writing to connection: %s\n", strerror(errno));
+        _queue.clear();
+        markDead();
+    }
+    if (_queue.empty()) setWantWrite(false);
+    if (_blocking && _queue.used() <= _queue.limit() / 2) {
+        PRINTF("clientItem: output queue drained - releasing child output\n");
+        _blocking = false;
+        connectionItem::resumeInput(instance);
+    }
 }
 
 // Event handler for libtelnet
@@ -311,6 +547,12 @@ void clientItem::telnet_eh(telnet_t *telnet, telnet_event_t *event, void *user_d
     }
 }
 
-int clientItem::_users;
-int clientItem::_loggers;
+bool clientItem::getClientMetrics(clientMetrics &m) const
+{
+    m = _metrics;
+    m.queued = _queue.bytes();
+    return true;
+}
+
+unsigned long clientItem::_connections;
 int clientItem::_status;
@@ -7,15 +7,24 @@
 #include <stdio.h>
 #include <errno.h>
 #include "procServ.h"
+#include "childInstance.h"
+#include "outputQueue.h"
 
 // This does I/O to stdio stdin and stdout
 
-connectionItem::connectionItem(int fd, bool readonly)
+connectionItem::connectionItem(int fd, bool readonly, childInstance *instance)
 {
     _fd = fd;
+    this->instance = instance;
+    memberNext = memberPrev = NULL;
     _readonly = readonly;
     _markedForDeletion = false;
     _log_stamp_sent = false;
+    _wantWrite = false;
+    _wantRead = true;
+    watchedFd = -1;
+    watchedWrite = false;
+    watchedRead = true;
 }
 
 connectionItem::~connectionItem()
@@ -24,6 +33,45 @@ connectionItem::~connectionItem()
     if (_fd >= 0) close(_fd);
 }
 
+// Default: no sharing, send the plain message
+int connectionItem::Send(sharedOutput &out)
+{
+    return Send(out.message, out.count);
+}
+
+// Register / unregister interest in the fd becoming writable
+void connectionItem::setWantWrite(bool want)
+{
+    if (want == _wantWrite) return;
+    _wantWrite = want;
+    if (watchedFd >= 0) UpdateConnection(this);
+}
+
+void connectionItem::pauseInput()
+{
+    if (!_wantRead) return;
+    PRINTF("Pausing input from connection %p\n", this);
+    _wantRead = false;
+    if (instance) instance->inputPaused = true;
+    if (watchedFd >= 0) UpdateConnection(this);
+}
+
+void connectionItem::resumeInput(childInstance *instance)
+{
+    if (!instance->inputPaused) return;
+    instance->inputPaused = false;
+    for (connectionItem *p = instance->members; p; p = p->memberNext) {
+        if (p->_wantRead) continue;
+        if (p->stayPaused()) {
+            instance->inputPaused = true;
+            continue;
+        }
+        PRINTF("Resuming input from connection %p\n", p);
+        p->_wantRead = true;
+        if (p->watchedFd >= 0) UpdateConnection(p);
+    }
+}
+
 // Called if sig child received
 // default implementation: empty (only the IOC connection does implement this)
 void connectionItem::markDeadIfChildIs(pid_t pid) {}
@@ -0,0 +1,286 @@
+// Process server for soft ioc
+// Ralph Lange <ralph.lange@gmx.de> 2007-2019
+// GNU Public License (GPLv3) applies - see www.gnu.org
+
+#include <vector>
+
+#include <unistd.h>
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <limits.h>
+#include <sys/select.h>
+
+#include "procServ.h"
+#include "eventLoop.h"
+
+#ifdef USE_EPOLL
+#include <sys/epoll.h>
+#endif
+
+// pselectLoop: the portable fallback
+// Rebuilds the fd_set from the connection list on every wakeup
+class pselectLoop : public eventLoop
+{
+public:
+    const char *name() const { return "pselect"; }
+    void add(connectionItem *ci) { update(ci); }
+    void remove(connectionItem *ci) { ci->watchedFd = -1; }
+    void update(connectionItem *ci) {
+        ci->watchedFd = ci->getFd();
+        ci->watchedWrite = ci->wantsWrite();
+        ci->watchedRead = ci->wantsRead();
+    }
+    int wait(const struct timespec *timeout, const sigset_t *sigmask);
+    void dispatch();
+private:
+    fd_set _fdset;
+    fd_set _wrset;
+};
+
+int pselectLoop::wait(const struct timespec *timeout, const sigset_t *sigmask)
+{
+    connectionItem *p;
+    int fd, nFd = -1;
+
+    // Prepare FD sets for select()
+    FD_ZERO(&_fdset);
+    FD_ZERO(&_wrset);
+    for (p = connectionItem::head; p; p = p->next) {
+        if ((fd = p->getFd()) > -1) {     // Connection needs to be watched
+            if (fd > nFd) nFd = fd;
+            if (p->wantsRead()) FD_SET(fd, &_fdset);
+            if (p->wantsWrite()) FD_SET(fd, &_wrset);
+        }
+    }
+    nFd++;
+
+    return pselect(nFd, &_fdset, &_wrset, NULL, timeout, sigmask);
+}
+
+void pselectLoop::dispatch()
+{
+    int fd;
+
+    // Loop through all connections
+    for (connectionItem *p = connectionItem::head; p; p = p->next) {
+        if ((fd = p->getFd()) < 0) continue;
+        if (FD_ISSET(fd, &_wrset) && p->wantsWrite()) p->flushToFd();
+        if (FD_ISSET(fd, &_fdset)) p->readFromFd();
+    }
+}
+
+#ifdef USE_EPOLL
+// epollLoop: Linux epoll backend
+// Each item is registered once, a wakeup only touches the ready items
+class epollLoop : public eventLoop
+{
+public:
+    epollLoop(int epfd) : _epfd(epfd), _nReady(0) {}
+    ~epollLoop() { close(_epfd); }
+    const char *name() const { return "epoll"; }
+    void add(connectionItem *ci);
+    void remove(connectionItem *ci);
+    void update(connectionItem *ci);
+    int wait(const struct timespec *timeout, const sigset_t *sigmask);
+    void dispatch();
+private:
+    // epoll events for the current read/write interest of an item
+    // (a paused item still gets EPOLLHUP / EPOLLERR, and reads its EOF)
+    static uint32_t interest(connectionItem *ci) {
+        ci->watchedRead = ci->wantsRead();
+        ci->watchedWrite = ci->wantsWrite();
+        return (ci->watchedRead ? (uint32_t) EPOLLIN : 0u) | (ci->watchedWrite ? (uint32_t) EPOLLOUT : 0u);
+    }
+    enum { MAX_EVENTS = 64 };
+    int _epfd;
+    int _nReady;
+    struct epoll_event _events[MAX_EVENTS];
+    // fds that epoll refuses (e.g. /dev/null or a plain file on stdin)
+    // are always ready, like select() reports them
+    std::vector<connectionItem *> _alwaysReady;
+};
+
+void epollLoop::add(connectionItem *ci)
+{
+    struct epoll_event ev;
+    int fd = ci->getFd();
+
+    ci->watchedFd = -1;
+    if (fd < 0) return;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = interest(ci);
+    ev.data.ptr = ci;
+    if (epoll_ctl(_epfd, EPOLL_CTL_ADD, fd, &ev) == 0) {
+        ci->watchedFd = fd;
+    } else if (errno == EPERM) {
+        PRINTF("epoll: fd %d can not be polled, treating it as always ready\n", fd);
+        ci->watchedFd = fd;
+        _alwaysReady.push_back(ci);
+    } else {
+        fprintf(stderr, "%s: epoll_ctl(ADD, %d) failed: %s\n",
+                procservName, fd, strerror(errno));
+    }
+}
+
+void epollLoop::remove(connectionItem *ci)
+{
+    for (size_t i = 0; i < _alwaysReady.size(); i++) {
+        if (_alwaysReady[i] == ci) {
+            _alwaysReady.erase(_alwaysReady.begin() + i);
+            ci->watchedFd = -1;
+            return;
+        }
+    }
+    if (ci->watchedFd >= 0) {
+        epoll_ctl(_epfd, EPOLL_CTL_DEL, ci->watchedFd, NULL);
+        ci->watchedFd = -1;
+    }
+    // Drop events of this item that were not dispatched yet
+    for (int i = 0; i < _nReady; i++) {
+        if (_events[i].data.ptr == ci) _events[i].data.ptr = NULL;
+    }
+}
+
+void epollLoop::update(connectionItem *ci)
+{
+    struct epoll_event ev;
+
+    if (ci->watchedFd != ci->getFd()) {
+        remove(ci);
+        add(ci);
+    } else if (ci->watchedFd >= 0 && (ci->watchedWrite != ci->wantsWrite()
+                                      || ci->watchedRead != ci->wantsRead())) {
+        memset(&ev, 0, sizeof(ev));
+        ev.events = interest(ci);
+        ev.data.ptr = ci;
+        // Fails for always ready fds, they are never waited for anyway
+        epoll_ctl(_epfd, EPOLL_CTL_MOD, ci->watchedFd, &ev);
+    }
+}
+
+int epollLoop::wait(const struct timespec *timeout, const sigset_t *sigmask)
+{
+    int ms = -1;
+
+    if (!_alwaysReady.empty()) {
+        ms = 0;
+    } else if (timeout) {             // Round up, so we never wake too early
+        if (timeout->tv_sec >= INT_MAX / 1000)
+            ms = INT_MAX;             // epoll can't wait longer (~24 days)
+        else
+            ms = timeout->tv_sec * 1000 + (timeout->tv_nsec + 999999) / 1000000;
+    }
+
+    _nReady = epoll_pwait(_epfd, _events, MAX_EVENTS, ms, sigmask);
+    if (_nReady < 0) {
+        int err = errno;
+        _nReady = 0;
+        errno = err;
+        return -1;
+    }
+    return _nReady + _alwaysReady.size();
+}
+
+void epollLoop::dispatch()
+{
+    connectionItem *p;
+
+    // Ready items may be added while dispatching (accept), but they are
+    // only deleted during housekeeping, so the pointers stay valid
+    for (int i = 0; i < _nReady; i++) {
+        if (!(p = (connectionItem *) _events[i].data.ptr)) continue;
+        if ((_events[i].events & EPOLLOUT) && p->wantsWrite()) p->flushToFd();
+        if (_events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) p->readFromFd();
+    }
+    _nReady = 0;
+    for (size_t i = 0; i < _alwaysReady.size(); i++) {
+        p = _alwaysReady[i];
+        if (p->wantsWrite()) p->flushToFd();
+        if (p->wantsRead()) p->readFromFd();
+    }
+}
+#endif /* USE_EPOLL */
+
+eventLoop * eventLoopFactory()
+{
+#ifdef USE_EPOLL
+    int epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd >= 0) return new epollLoop(epfd);
+    PRINTF("epoll_create1 failed (%s), falling back to pselect\n", strerror(errno));
+#endif
+    return new pselectLoop;
+}
+
+eventTimer * eventTimer::_head;
+
+eventTimer::eventTimer(void (*callback)(void))
+    : _callback(callback), _armed(false), _next(_head)
+{
+    _head = this;
+}
+
+eventTimer::~eventTimer()
+{
+    for (eventTimer **pt = &_head; *pt; pt = &(*pt)->_next) {
+        if (*pt == this) {
+            *pt = _next;
+            break;
+        }
+    }
+}
+
+void eventTimer::armIn(long ms)
+{
+    clock_gettime(CLOCK_MONOTONIC, &_deadline);
+    _deadline.tv_sec += ms / 1000;
+    _deadline.tv_nsec += (ms % 1000) * 1000000l;
+    if (_deadline.tv_nsec >= 1000000000l) {
+        _deadline.tv_sec++;
+        _deadline.tv_nsec -= 1000000000l;
+    }
+    _armed = true;
+}
+
+bool eventTimer::nextTimeout(struct timespec *timeout)
+{
+    struct timespec now;
+    const struct timespec *first = NULL;
+
+    for (eventTimer *t = _head; t; t = t->_next) {
+        if (t->_armed && (!first || t->_deadline.tv_sec < first->tv_sec
+                          || (t->_deadline.tv_sec == first->tv_sec
+                              && t->_deadline.tv_nsec < first->tv_nsec)))
+            first = &t->_deadline;
+    }
+    if (!first) return false;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    timeout->tv_sec = first->tv_sec - now.tv_sec;
+    timeout->tv_nsec = first->tv_nsec - now.tv_nsec;
+    if (timeout->tv_nsec < 0) {
+        timeout->tv_sec--;
+        timeout->tv_nsec += 1000000000l;
+    }
+    if (timeout->tv_sec < 0) {               // Overdue
+        timeout->tv_sec = 0;
+        timeout->tv_nsec = 0;
+    }
+    return true;
+}
+
+void eventTimer::runExpired()
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    for (eventTimer *t = _head; t; t = t->_next) {
+        if (t->_armed && (t->_deadline.tv_sec < now.tv_sec
+                          || (t->_deadline.tv_sec == now.tv_sec
+                              && t->_deadline.tv_nsec <= now.tv_nsec))) {
+            t->_armed = false;
+            if (t->_callback) t->_callback();
+        }
+    }
+}
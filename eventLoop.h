@@ -0,0 +1,81 @@
+// Process server for soft ioc
+// Ralph Lange <ralph.lange@gmx.de> 2007-2019
+// GNU Public License (GPLv3) applies - see www.gnu.org
+
+
+#ifndef eventLoopH
+#define eventLoopH
+
+#include <signal.h>
+#include <time.h>
+
+#include "procServ.h"
+
+/* whether to use the Linux epoll backend */
+#if defined(HAVE_SYS_EPOLL_H)
+# define USE_EPOLL
+#endif
+
+// eventLoop class definition
+// Waits for activity on the fds of all connection items and
+// dispatches the ones that are ready.
+// Connection items are registered once (AddConnection) and
+// unregistered once (DeleteConnection), so that a backend can keep
+// its own interest set instead of rebuilding it on every wakeup.
+class eventLoop
+{
+public:
+    virtual ~eventLoop() {}
+
+    virtual const char *name() const = 0;
+
+    // Start / stop watching the fd of a connection item
+    virtual void add(connectionItem *ci) = 0;
+    virtual void remove(connectionItem *ci) = 0;
+
+    // Bring the watch in line with the current fd and read/write interest
+    // of a connection item
+    virtual void update(connectionItem *ci) = 0;
+
+    // Wait for activity, atomically unblocking the signals in sigmask.
+    // timeout==NULL waits forever.
+    // Returns the number of ready items, 0 on timeout, -1 on error (see errno)
+    virtual int wait(const struct timespec *timeout, const sigset_t *sigmask) = 0;
+
+    // Call readFromFd() / flushToFd() on the items that the last wait()
+    // found ready
+    virtual void dispatch() = 0;
+};
+
+// Creates the best event loop backend available on this host
+eventLoop * eventLoopFactory();
+
+// eventTimer class definition
+// A deadline for the main loop. The loop sleeps until the earliest armed
+// timer expires (forever if none is armed), so an idle server does not
+// wake up at all.
+class eventTimer
+{
+public:
+    eventTimer(void (*callback)(void) = NULL);
+    ~eventTimer();
+
+    // (Re-)arm the timer to expire ms milliseconds from now
+    void armIn(long ms);
+    void cancel() { _armed = false; }
+    bool armed() const { return _armed; }
+
+    // Time until the earliest deadline; false if no timer is armed
+    static bool nextTimeout(struct timespec *timeout);
+    // Disarm expired timers and call their callbacks
+    static void runExpired();
+
+private:
+    void (*_callback)(void);  // NULL: only wakes up the main loop
+    bool _armed;
+    struct timespec _deadline;
+    eventTimer *_next;
+    static eventTimer *_head;
+};
+
+#endif /* #ifndef eventLoopH */
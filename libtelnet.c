@@ -980,6 +980,31 @@ static void _process(telnet_t *telnet, const char *buffer, size_t size) {
 		switch (telnet->state) {
 		/* regular data */
 		case TELNET_STATE_DATA:
+			/* fast path: skip ahead to the next byte that needs
+			 * attention (IAC, or CR with NVT EOL translation), so that
+			 * runs of plain data are found with memchr() and passed
+			 * through in one event */
+			if (byte != TELNET_IAC && byte != '\r') {
+				const char *end = buffer + size;
+				const char *next = (const char *)memchr(buffer + i,
+						TELNET_IAC, end - (buffer + i));
+				if (next == 0)
+					next = end;
+				if ((telnet->flags & TELNET_FLAG_NVT_EOL) &&
+						!(telnet->flags & TELNET_FLAG_RECEIVE_BINARY)) {
+					const char *cr = (const char *)memchr(buffer + i,
+							'\r', next - (buffer + i));
+					if (cr != 0)
+						next = cr;
+				}
+				if (next == end) {
+					i = size - 1;
+					break;
+				}
+				i = next - buffer;
+				byte = *next;
+			}
+
 			/* on an IAC byte, pass through all pending bytes and
 			 * switch states */
 			if (byte == TELNET_IAC) {
@@ -1332,25 +1357,30 @@ void telnet_negotiate(telnet_t *telnet, unsigned char cmd,
 /* send non-command data (escapes IAC bytes) */
 void telnet_send(telnet_t *telnet, const char *buffer,
 		size_t size) {
-	size_t i, l;
+	const char *end = buffer + size;
+	const char *iac;
 
-	for (l = i = 0; i != size; ++i) {
-		/* dump prior portion of text, send escaped bytes */
-		if (buffer[i] == (char)TELNET_IAC) {
-			/* dump prior text if any */
-			if (i != l) {
-				_send(telnet, buffer + l, i - l);
-			}
-			l = i + 1;
+	if (size == 0)
+		return;
 
-			/* send escape */
-			telnet_iac(telnet, TELNET_IAC);
+	/* IAC bytes are rare in regular output: find them with memchr()
+	 * (vectorized by the C library) and send the spans between them
+	 * in one piece */
+	while ((iac = (const char *)memchr(buffer, TELNET_IAC,
+			end - buffer)) != 0) {
+		/* dump prior text if any */
+		if (iac != buffer) {
+			_send(telnet, buffer, iac - buffer);
 		}
+		buffer = iac + 1;
+
+		/* send escape */
+		telnet_iac(telnet, TELNET_IAC);
 	}
 
 	/* send whatever portion of buffer is left */
-	if (i != l) {
-		_send(telnet, buffer + l, i - l);
+	if (buffer != end) {
+		_send(telnet, buffer, end - buffer);
 	}
 }
 
@@ -0,0 +1,660 @@
+// Process server for soft ioc
+// Ralph Lange <ralph.lange@gmx.de> 2007-2019
+// GNU Public License (GPLv3) applies - see www.gnu.org
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <limits.h>
+#include <vector>
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#include "procServ.h"
+#include "childInstance.h"
+#include "metrics.h"
+
+// Log file writing
+// Output is collected in blocks that are handed to a writer thread, so
+// that a slow disk (or NFS server) does not stall the main loop.
+// The main loop wakes the writer up once per iteration (group commit);
+// the writer takes all queued blocks, writes them with as few writev()
+// calls as possible, and fsync()s according to the durability policy.
+// Memory is bounded by --log-buffer. When all blocks are queued,
+// --log-overflow selects whether the main loop waits for the writer
+// (block) or the data is dropped, leaving a marker in the log (drop).
+// The main thread fills the blocks at the end of the queue, the writer
+// only touches them after taking them off the queue; both hold logLock
+// while touching the queue.
+// With --log-gzip, the writer compresses the output into a series of gzip
+// members (frames) that can each be decoded on their own. A frame is
+// finished after LOGFRAME_MAX of input, and when the file is closed.
+// Before an fsync(), the compressor is flushed (Z_SYNC_FLUSH), so all
+// synced output can be decoded even if the frame is never finished.
+
+LogSyncMode logSyncMode = logSyncAlways;  // Log file durability policy
+long   logSyncArg;               // Policy parameter (ms / bytes)
+size_t logBufferSize = 1024*1024;         // Memory for blocks to be written
+LogOverflow logOverflow = logOverflowBlock;  // What to do when it is used up
+int    logGzipLevel;             // Compression level (0: plain log file)
+
+#define LOGBLOCK_SIZE (64*1024)
+#define LOGFRAME_MAX (1024*1024)  // Finish a frame after this much input anyway
+
+struct logBlock
+{
+    childInstance *in;
+    bool   reopen;               // Reopen the log file (SIGHUP, no data)
+    size_t len;
+    char   data[LOGBLOCK_SIZE];
+};
+
+static pthread_mutex_t logLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t logWork;   // Writer: blocks queued, sync requested
+static pthread_cond_t logDone;   // Main: blocks written and free again
+static bool writerRunning;
+static bool writerFailed;        // No thread: write synchronously
+static std::vector<logBlock *> logQueue;  // Blocks to be written
+static std::vector<logBlock *> logFree;
+static size_t logBlocks, logMaxBlocks;    // Allocated / allowed blocks
+static size_t logQueued;                  // Bytes in logQueue
+static unsigned long long logPushed, logWritten;  // Blocks queued / written
+static bool syncRequested;               // logFlush(true) waits for it
+
+// Wrapper to ignore return values
+template<typename T>
+inline void ignore_result(T /* unused result */) {}
+
+// Write out fragments, using as few writev() calls as possible
+static void logWritevFd(int fd, struct iovec *iov, int n)
+{
+    ssize_t status;
+    while (n > 0) {
+        while (-1 == (status = writev(fd, iov, n < IOV_MAX ? n : IOV_MAX))
+               && errno == EINTR);
+        count(metrics.logWrites, 1);
+        if (status <= 0) return;    // Don't stop here - just go without
+        count(metrics.logBytesWritten, status);
+        while (n > 0 && (size_t) status >= iov->iov_len) {
+            status -= iov->iov_len;
+            iov++;
+            n--;
+        }
+        if (n > 0) {
+            iov->iov_base = (char *) iov->iov_base + status;
+            iov->iov_len -= status;
+        }
+    }
+}
+
+static long msSince(const struct timespec *then)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - then->tv_sec) * 1000
+            + (now.tv_nsec - then->tv_nsec) / 1000000;
+}
+
+#ifdef HAVE_ZLIB
+// Compression state of an instance's log file (writer thread)
+struct logFrame
+{
+    z_stream zs;
+    size_t in;                   // Input in the current frame (0: none open)
+    size_t unflushed;            // Input since the last flush
+    unsigned char out[LOGBLOCK_SIZE];
+};
+
+// Compress data into the current frame
+// flush: Z_NO_FLUSH, Z_SYNC_FLUSH (all input can be decoded from the file),
+// or Z_FINISH (finish the frame)
+// Returns the number of bytes written, or -1 if compression is not possible
+static long logDeflate(childInstance *in, char *buf, size_t len, int flush)
+{
+    logFrame *f = in->logZ;
+    long written = 0;
+    int status;
+
+    if (!f) {
+        if (!len) return 0;
+        f = (logFrame *) calloc(1, sizeof(logFrame));
+        if (!f) return -1;
+        if (deflateInit2(&f->zs, logGzipLevel, Z_DEFLATED, 15 + 16, 8,
+                         Z_DEFAULT_STRATEGY) != Z_OK) {
+            free(f);
+            return -1;
+        }
+        in->logZ = f;
+    }
+    if (!f->in && !len) return 0;        // No frame to finish
+    if (flush == Z_SYNC_FLUSH && !f->unflushed && !len) return 0;
+
+    f->zs.next_in = (Bytef *) buf;
+    f->zs.avail_in = len;
+    do {
+        f->zs.next_out = f->out;
+        f->zs.avail_out = sizeof(f->out);
+        status = deflate(&f->zs, flush);
+        size_t n = sizeof(f->out) - f->zs.avail_out;
+        if (n) {
+            struct iovec iov = { f->out, n };
+            logWritevFd(in->logWriterFd, &iov, 1);
+            written += n;
+        }
+    } while (flush == Z_FINISH ? status == Z_OK : f->zs.avail_out == 0);
+    f->in += len;
+    f->unflushed = flush == Z_NO_FLUSH ? f->unflushed + len : 0;
+    count(metrics.logBytesDeflated, len);
+    if (flush == Z_FINISH) {
+        deflateReset(&f->zs);
+        f->in = 0;
+        count(metrics.logFrames, 1);
+    }
+    return written;
+}
+#endif /* HAVE_ZLIB */
+
+// Flush the current frame of a compressed log file (Z_SYNC_FLUSH),
+// or finish it if end is set
+// Returns the number of bytes written
+static size_t logFrameFlush(childInstance *in, bool end)
+{
+#ifdef HAVE_ZLIB
+    if (in->logZ && in->logWriterFd > 1) {
+        long n = logDeflate(in, NULL, 0, end ? Z_FINISH : Z_SYNC_FLUSH);
+        if (n > 0) {
+            in->logSize += n;
+            return n;
+        }
+    }
+#endif
+    return 0;
+}
+
+static void logSync(childInstance *in)
+{
+    logFrameFlush(in, false);
+    ignore_result( fsync(in->logWriterFd) );
+    count(metrics.logFsyncs, 1);
+    in->logUnsynced = 0;
+    clock_gettime(CLOCK_MONOTONIC, &in->logLastSync);
+}
+
+// Parse the --logsync argument
+// Returns false if the argument is not valid
+bool parseLogSync(const char *arg)
+{
+    char *end;
+
+    if (strcmp(arg, "always") == 0) {
+        logSyncMode = logSyncAlways;
+    } else if (strcmp(arg, "none") == 0) {
+        logSyncMode = logSyncNone;
+    } else if (strncmp(arg, "periodic:", 9) == 0) {
+        logSyncMode = logSyncPeriodic;
+        logSyncArg = strtol(arg + 9, &end, 10);
+        if (end == arg + 9 || *end || logSyncArg <= 0) return false;
+    } else if (strncmp(arg, "bytes:", 6) == 0) {
+        logSyncMode = logSyncBytes;
+        logSyncArg = strtol(arg + 6, &end, 10);
+        if (*end == 'k' || *end == 'K') { logSyncArg *= 1024; end++; }
+        else if (*end == 'M') { logSyncArg *= 1024*1024; end++; }
+        if (end == arg + 6 || *end || logSyncArg <= 0) return false;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// Parse the --log-buffer argument (bytes, k and M suffixes allowed)
+// Returns false if the argument is not valid
+bool parseLogBufferSize(const char *arg)
+{
+    char *end;
+    long n = strtol(arg, &end, 10);
+
+    if (*end == 'k' || *end == 'K') { n *= 1024; end++; }
+    else if (*end == 'M') { n *= 1024*1024; end++; }
+    if (end == arg || *end || n <= 0) return false;
+    logBufferSize = n;
+    return true;
+}
+
+// Parse the --log-overflow argument
+bool parseLogOverflow(const char *arg)
+{
+    if (strcmp(arg, "block") == 0) {
+        logOverflow = logOverflowBlock;
+    } else if (strcmp(arg, "drop") == 0) {
+        logOverflow = logOverflowDrop;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// Open the log file of an instance (not stdout)
+static void logOpen(childInstance *in)
+{
+    struct stat st;
+
+    in->logWriterFd = open(in->logFile, O_CREAT|O_WRONLY|O_APPEND, S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH);
+    if (-1 == in->logWriterFd) return;    // Don't stop here - just go without
+    // Not for the children
+    fcntl(in->logWriterFd, F_SETFD, FD_CLOEXEC);
+    in->logSize = fstat(in->logWriterFd, &st) == 0 ? st.st_size : 0;
+    in->logRotateAt = logRotateNext(time(NULL));
+    clock_gettime(CLOCK_MONOTONIC, &in->logLastSync);
+}
+
+// Close the log file of an instance (writer thread), fsync() unless policy is none
+static void logClose(childInstance *in)
+{
+    if (in->logWriterFd <= 1) return;
+    in->logUnsynced += logFrameFlush(in, true);
+    if (logSyncMode != logSyncNone && in->logUnsynced) {
+        ignore_result( fsync(in->logWriterFd) );
+        count(metrics.logFsyncs, 1);
+    }
+    close(in->logWriterFd);
+    in->logWriterFd = -1;
+    in->logUnsynced = 0;
+}
+
+// fsync() the instances written to, as the policy says
+// force: finish the compressed frames and fsync() any unsynced data
+// (unless policy is none)
+static void logSyncAll(bool force)
+{
+    for (childInstance *in = childInstance::head; in; in = in->next) {
+        if (force) in->logUnsynced += logFrameFlush(in, true);
+        if (!in->logUnsynced) continue;
+        switch (logSyncMode) {
+        case logSyncNone:
+            in->logUnsynced = 0;
+            break;
+        case logSyncAlways:
+            logSync(in);
+            break;
+        case logSyncBytes:
+            if (force || in->logUnsynced >= (size_t) logSyncArg) logSync(in);
+            break;
+        case logSyncPeriodic:
+            if (force || msSince(&in->logLastSync) >= logSyncArg) logSync(in);
+            break;
+        }
+    }
+}
+
+// Earliest periodic fsync() that is due (false if none)
+static bool logSyncDeadline(struct timespec *deadline)
+{
+    const struct timespec *first = NULL;
+
+    if (logSyncMode != logSyncPeriodic) return false;
+    for (childInstance *in = childInstance::head; in; in = in->next) {
+        if (in->logUnsynced && (!first || in->logLastSync.tv_sec < first->tv_sec
+                                || (in->logLastSync.tv_sec == first->tv_sec
+                                    && in->logLastSync.tv_nsec < first->tv_nsec)))
+            first = &in->logLastSync;
+    }
+    if (!first) return false;
+    deadline->tv_sec = first->tv_sec + logSyncArg / 1000;
+    deadline->tv_nsec = first->tv_nsec + (logSyncArg % 1000) * 1000000l;
+    if (deadline->tv_nsec >= 1000000000l) {
+        deadline->tv_sec++;
+        deadline->tv_nsec -= 1000000000l;
+    }
+    return true;
+}
+
+// Fragments for consecutive writes to the same fd, written in one writev()
+class logIovs
+{
+public:
+    logIovs() : _n(0), _fd(-1) {}
+    void add(int fd, char *buf, size_t len) {
+        if (_n && (fd != _fd || _n == IOVS)) flush();
+        _fd = fd;
+        _iov[_n].iov_base = buf;
+        _iov[_n].iov_len = len;
+        _n++;
+    }
+    void flush() {
+        if (_n) logWritevFd(_fd, _iov, _n);
+        _n = 0;
+    }
+private:
+    enum { IOVS = 64 };
+    struct iovec _iov[IOVS];
+    int _n;
+    int _fd;
+};
+
+// Add data for the log file of an instance
+// Returns the number of bytes that go into the file
+static size_t logPut(logIovs &out, childInstance *in, char *buf, size_t len)
+{
+#ifdef HAVE_ZLIB
+    if (logGzipLevel && in->logWriterFd > 1) {
+        out.flush();
+        bool end = in->logZ && in->logZ->in + len >= LOGFRAME_MAX;
+        long n = logDeflate(in, buf, len, end ? Z_FINISH : Z_NO_FLUSH);
+        if (n >= 0) return n;
+    }
+#endif
+    out.add(in->logWriterFd, buf, len);
+    return len;
+}
+
+// Close and open the log file of an instance again (SIGHUP)
+static void logReopen(childInstance *in)
+{
+    logClose(in);
+    if (in->logWriterFd != 1) logOpen(in);
+}
+
+// Write data to the log file of an instance, rotating it first if needed
+static void logWriteData(logIovs &out, childInstance *in, char *p, size_t len)
+{
+    if (in->logWriterFd < 0) return;
+
+    if (logRotateDue(in, len)) {
+        // Finish the current line in the old file
+        char *nl = in->logMidLine ? (char *) memchr(p, '\n', len) : NULL;
+        size_t head = nl ? nl - p + 1 : 0;
+        if (head) {
+            logPut(out, in, p, head);
+            in->logUnsynced += head;
+            in->logMidLine = false;
+            p += head;
+            len -= head;
+        }
+        out.flush();
+        logClose(in);
+        logRotate(in);
+        logOpen(in);
+        if (in->logWriterFd < 0) return;
+    }
+    if (len) {
+        in->logSize += logPut(out, in, p, len);
+        in->logUnsynced += len;
+        in->logMidLine = p[len - 1] != '\n';
+    }
+}
+
+// Write a batch of blocks
+static void logWriteBatch(std::vector<logBlock *> &batch)
+{
+    logIovs out;
+
+    for (size_t i = 0; i < batch.size(); i++) {
+        logBlock *b = batch[i];
+        if (b->reopen) {
+            out.flush();
+            logReopen(b->in);
+        } else {
+            logWriteData(out, b->in, b->data, b->len);
+        }
+    }
+    out.flush();
+}
+
+// The writer thread
+static void * logWriter(void *)
+{
+    static std::vector<logBlock *> batch;
+    struct timespec deadline;
+
+    batch.reserve(logQueue.capacity());
+    pthread_mutex_lock(&logLock);
+    for (;;) {
+        while (logQueue.empty() && !syncRequested) {
+            if (!logSyncDeadline(&deadline)) {
+                pthread_cond_wait(&logWork, &logLock);
+            } else if (pthread_cond_timedwait(&logWork, &logLock, &deadline) == ETIMEDOUT) {
+                break;
+            }
+        }
+        bool sync = syncRequested;
+        batch.swap(logQueue);
+        for (size_t i = 0; i < batch.size(); i++) {
+            if (batch[i]->in->logCur == batch[i]) batch[i]->in->logCur = NULL;
+            logQueued -= batch[i]->len;
+        }
+        pthread_mutex_unlock(&logLock);
+
+        logWriteBatch(batch);
+        logSyncAll(sync);
+
+        pthread_mutex_lock(&logLock);
+        for (size_t i = 0; i < batch.size(); i++) {
+            if (batch[i]->reopen) free(batch[i]);
+            else logFree.push_back(batch[i]);
+        }
+        logWritten += batch.size();
+        batch.clear();
+        if (sync) syncRequested = false;
+        pthread_cond_broadcast(&logDone);
+    }
+    return NULL;
+}
+
+// Start the writer thread (after the server forked into the background)
+static void startWriter()
+{
+    pthread_condattr_t attr;
+    pthread_t tid;
+    sigset_t all, old;
+    int status;
+
+    logMaxBlocks = logBufferSize / LOGBLOCK_SIZE;
+    if (logMaxBlocks < 2) logMaxBlocks = 2;       // Fill one while the other is written
+    // No allocations in the writer thread
+    logFree.reserve(logMaxBlocks);
+    logQueue.reserve(logMaxBlocks + 16);
+
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&logWork, &attr);
+    pthread_cond_init(&logDone, &attr);
+    pthread_condattr_destroy(&attr);
+
+    // Signals are for the main loop
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    status = pthread_create(&tid, NULL, logWriter, NULL);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (status) {
+        fprintf(stderr, "%s: unable to start log writer thread (%s), writing synchronously\n",
+                procservName, strerror(status));
+        writerFailed = true;
+        return;
+    }
+    pthread_detach(tid);
+    PRINTF("Started log writer thread\n");
+    writerRunning = true;
+}
+
+// Queue a new block for an instance (logLock held)
+// Waits for the writer (policy block) or returns NULL (policy drop)
+// if all blocks are queued
+static logBlock * newBlock(childInstance *in)
+{
+    logBlock *b = NULL;
+
+    while (!b) {
+        if (!logFree.empty()) {
+            b = logFree.back();
+            logFree.pop_back();
+        } else if (logBlocks < logMaxBlocks) {
+            if (!(b = (logBlock *) malloc(sizeof(logBlock)))) return NULL;
+            logBlocks++;
+        } else if (logOverflow == logOverflowDrop) {
+            return NULL;
+        } else {
+            metrics.logBlocked++;
+            pthread_cond_signal(&logWork);
+            pthread_cond_wait(&logDone, &logLock);
+        }
+    }
+    b->in = in;
+    b->reopen = false;
+    b->len = 0;
+    if (in->logDropped) {
+        b->len = snprintf(b->data, LOGBLOCK_SIZE, "\r\n@@@ %lu bytes dropped\r\n",
+                          (unsigned long) in->logDropped);
+        logQueued += b->len;
+        in->logDropped = 0;
+    }
+    logQueue.push_back(b);
+    logPushed++;
+    in->logCur = b;
+    return b;
+}
+
+// Open the log file of an instance, or reopen it (SIGHUP)
+// Once the writer thread runs, it owns the file; in->logFileFD only tells
+// whether logging is on. A reopen is queued after the pending output.
+// If the thread could not be started, the main thread does its work.
+void openLogFile(childInstance *in)
+{
+    int oldFd = in->logFileFD;
+    struct stat st;
+
+    if (writerFailed && -1 != oldFd) {   // Like the writer thread does
+        logReopen(in);
+        return;
+    }
+    if (writerRunning && -1 != oldFd) {
+        logBlock *b = (logBlock *) malloc(offsetof(logBlock, data));
+        if (!b) return;
+        b->in = in;
+        b->reopen = true;
+        b->len = 0;
+        pthread_mutex_lock(&logLock);
+        logQueue.push_back(b);
+        logPushed++;
+        in->logCur = NULL;
+        pthread_cond_signal(&logWork);
+        pthread_mutex_unlock(&logLock);
+        return;
+    }
+
+    if (in->logFile && strcmp(in->logFile, "-")==0) {
+        in->logFileFD = 1;
+    } else
+    if (in->logFile) {
+        in->logFileFD = open(in->logFile, O_CREAT|O_WRONLY|O_APPEND, S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH);
+        if (-1 == in->logFileFD) {     // Don't stop here - just go without
+            fprintf(stderr,
+                    "%s: unable to open log file %s\n",
+                    procservName, in->logFile);
+        } else {
+            PRINTF("Opened file %s for logging\n", in->logFile);
+            // Not for the children
+            fcntl(in->logFileFD, F_SETFD, FD_CLOEXEC);
+        }
+    }
+
+    if (-1 != oldFd && 1 != oldFd) close(oldFd);
+    // (No instance data of the writer thread is touched while it has no blocks)
+    pthread_mutex_lock(&logLock);
+    in->logWriterFd = in->logFileFD;
+    in->logSize = (in->logFileFD > 1 && fstat(in->logFileFD, &st) == 0) ? st.st_size : 0;
+    in->logRotateAt = logRotateNext(time(NULL));
+    clock_gettime(CLOCK_MONOTONIC, &in->logLastSync);
+    pthread_mutex_unlock(&logLock);
+}
+
+// Add data to the log
+void logWrite(childInstance *in, const char *buf, size_t len)
+{
+    struct iovec iov = { (void *) buf, len };
+    logWritev(in, &iov, 1);
+}
+
+// Add fragments to the log
+// They are copied into the instance's block at the end of the queue,
+// new blocks are queued as needed
+void logWritev(childInstance *in, const struct iovec *iov, int n)
+{
+    int i;
+
+    if (in->logFileFD <= 0) return;
+    if (!writerRunning && !writerFailed) startWriter();
+    if (writerFailed) {                     // Like the writer thread, in the main thread
+        logIovs out;
+        for (i = 0; i < n; i++)
+            logWriteData(out, in, (char *) iov[i].iov_base, iov[i].iov_len);
+        out.flush();
+        logSyncAll(false);
+        return;
+    }
+
+    pthread_mutex_lock(&logLock);
+    for (i = 0; i < n; i++) {
+        const char *p = (const char *) iov[i].iov_base;
+        size_t len = iov[i].iov_len;
+        while (len) {
+            logBlock *b = in->logCur;
+            if (!b || b->len == LOGBLOCK_SIZE) b = newBlock(in);
+            if (!b) {                               // Policy drop
+                in->logDropped += len;
+                metrics.logBytesDropped += len;
+                in->counters.logBytesDropped += len;
+                break;
+            }
+            size_t chunk = LOGBLOCK_SIZE - b->len < len ? LOGBLOCK_SIZE - b->len : len;
+            memcpy(b->data + b->len, p, chunk);
+            b->len += chunk;
+            logQueued += chunk;
+            p += chunk;
+            len -= chunk;
+        }
+    }
+    pthread_mutex_unlock(&logLock);
+}
+
+// Have the writer thread write out the queued blocks
+// force: also fsync() any unsynced data (unless policy is none), and
+// wait until that is done
+// Without the writer thread, only the sync policy is applied here
+void logFlush(bool force)
+{
+    if (writerFailed) logSyncAll(force);
+    if (!writerRunning) return;
+
+    pthread_mutex_lock(&logLock);
+    if (!logQueue.empty()) pthread_cond_signal(&logWork);
+    if (force) {
+        unsigned long long target = logPushed;
+        syncRequested = true;
+        pthread_cond_signal(&logWork);
+        while (syncRequested || logWritten < target)
+            pthread_cond_wait(&logDone, &logLock);
+    }
+    pthread_mutex_unlock(&logLock);
+}
+
+// Bytes waiting for the writer thread
+size_t logQueuedBytes()
+{
+    size_t n;
+
+    pthread_mutex_lock(&logLock);
+    n = logQueued;
+    pthread_mutex_unlock(&logLock);
+    return n;
+}
@@ -0,0 +1,249 @@
+// Process server for soft ioc
+// Ralph Lange <ralph.lange@gmx.de> 2007-2019
+// GNU Public License (GPLv3) applies - see www.gnu.org
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
+#include <limits.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <deque>
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#include "procServ.h"
+#include "childInstance.h"
+#include "metrics.h"
+
+// Log file rotation (--log-rotate-size, --log-rotate-interval)
+// Done by the log writer thread between two writes: it closes the log
+// file, shifts the generations (<log>.1 -> <log>.2 ...), renames the log
+// file to <log>.1 and opens a new one, so no output is lost or goes to
+// a file that was moved away. With --log-compress, a separate thread
+// gzips the rotated file; when it is done, it takes the place of the
+// generation it has become in the meantime.
+
+size_t logRotateSize;            // Rotate when the log would grow beyond (0: off)
+long   logRotateInterval;        // Rotate at multiples of this since midnight [s] (0: off)
+int    logKeep = 5;              // Rotated generations to keep
+bool   logCompress;              // gzip rotated generations
+
+// Generations are renamed while holding this, by the writer and the compressor
+static pthread_mutex_t rotateLock = PTHREAD_MUTEX_INITIALIZER;
+
+// Parse the --log-rotate-size argument (bytes, k, M and G suffixes allowed)
+// Returns false if the argument is not valid
+bool parseLogRotateSize(const char *arg)
+{
+    char *end;
+    long long n = strtoll(arg, &end, 10);
+
+    if (*end == 'k' || *end == 'K') { n *= 1024; end++; }
+    else if (*end == 'M') { n *= 1024*1024; end++; }
+    else if (*end == 'G') { n *= 1024*1024*1024ll; end++; }
+    if (end == arg || *end || n <= 0) return false;
+    logRotateSize = n;
+    return true;
+}
+
+// Parse the --log-rotate-interval argument:
+// hourly, daily, <n>m or <n>h (dividing a day, counted from midnight)
+bool parseLogRotateInterval(const char *arg)
+{
+    char *end;
+    long n;
+
+    if (strcmp(arg, "hourly") == 0) {
+        logRotateInterval = 3600;
+    } else if (strcmp(arg, "daily") == 0) {
+        logRotateInterval = 86400;
+    } else {
+        n = strtol(arg, &end, 10);
+        if (end == arg || n <= 0) return false;
+        if (strcmp(end, "m") == 0) n *= 60;
+        else if (strcmp(end, "h") == 0) n *= 3600;
+        else return false;
+        if (86400 % n) return false;
+        logRotateInterval = n;
+    }
+    return true;
+}
+
+// Next rotation time after now (0: no time based rotation)
+time_t logRotateNext(time_t now)
+{
+    struct tm tm;
+    time_t midnight;
+
+    if (!logRotateInterval) return 0;
+    localtime_r(&now, &tm);
+    tm.tm_hour = tm.tm_min = tm.tm_sec = 0;
+    tm.tm_isdst = -1;
+    midnight = mktime(&tm);
+    return midnight + ((now - midnight) / logRotateInterval + 1) * logRotateInterval;
+}
+
+// True if the log file of an instance has to be rotated before
+// writing len more bytes
+bool logRotateDue(childInstance *in, size_t len)
+{
+    if (in->logWriterFd <= 1) return false;        // Not for stdout
+    if (logRotateSize && in->logSize && in->logSize + len > logRotateSize)
+        return true;
+    if (in->logRotateAt && time(NULL) >= in->logRotateAt) {
+        if (in->logSize) return true;
+        in->logRotateAt = logRotateNext(time(NULL));   // Nothing to rotate yet
+    }
+    return false;
+}
+
+// Name of generation n of a log file
+static void genName(char *buf, const char *logFile, int n, bool gz)
+{
+    snprintf(buf, PATH_MAX, "%s.%d%s", logFile, n, gz ? ".gz" : "");
+}
+
+#ifdef HAVE_ZLIB
+// Compressor thread
+// Works through the rotated files one by one. A job keeps the rotated
+// file open, so it does not matter if the file gets shifted meanwhile.
+struct compressJob
+{
+    childInstance *in;
+    unsigned long rotation;      // in->logRotations when it became <log>.1
+    int fd;
+};
+
+static pthread_mutex_t compressLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t compressWork = PTHREAD_COND_INITIALIZER;
+static std::deque<compressJob> compressJobs;
+static bool compressorRunning;
+
+static bool compressFile(int fd, const char *tmp)
+{
+    char buf[64*1024];
+    ssize_t len;
+    int out = open(tmp, O_CREAT|O_TRUNC|O_WRONLY|O_CLOEXEC, S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH);
+    gzFile gz;
+    bool ok = true;
+
+    if (out < 0) return false;
+    if (!(gz = gzdopen(dup(out), "wb"))) {
+        close(out);
+        return false;
+    }
+    while ((len = read(fd, buf, sizeof(buf))) != 0) {
+        if (len < 0) {
+            if (errno == EINTR) continue;
+            ok = false;
+            break;
+        }
+        if (gzwrite(gz, buf, len) != len) {
+            ok = false;
+            break;
+        }
+    }
+    if (gzclose(gz) != Z_OK) ok = false;
+    if (ok && fsync(out)) ok = false;
+    close(out);
+    return ok;
+}
+
+static void * compressor(void *)
+{
+    char tmp[PATH_MAX], name[PATH_MAX], gzName[PATH_MAX];
+
+    pthread_mutex_lock(&compressLock);
+    for (;;) {
+        while (compressJobs.empty()) pthread_cond_wait(&compressWork, &compressLock);
+        compressJob job = compressJobs.front();
+        compressJobs.pop_front();
+        pthread_mutex_unlock(&compressLock);
+
+        snprintf(tmp, sizeof(tmp), "%s.gz-tmp", job.in->logFile);
+        bool ok = compressFile(job.fd, tmp);
+        close(job.fd);
+
+        // Replace the generation the file has become by now
+        pthread_mutex_lock(&rotateLock);
+        long n = job.in->logRotations - job.rotation + 1;
+        if (ok && n <= logKeep) {
+            genName(name, job.in->logFile, n, false);
+            genName(gzName, job.in->logFile, n, true);
+            if (rename(tmp, gzName) == 0) {
+                unlink(name);
+                count(metrics.logCompressions, 1);
+            }
+        } else {
+            unlink(tmp);
+        }
+        pthread_mutex_unlock(&rotateLock);
+
+        pthread_mutex_lock(&compressLock);
+    }
+    return NULL;
+}
+
+// Queue <log>.1 for compression
+static void compressLater(childInstance *in)
+{
+    char name[PATH_MAX];
+    compressJob job;
+    pthread_t tid;
+
+    genName(name, in->logFile, 1, false);
+    job.in = in;
+    job.rotation = in->logRotations;
+    if ((job.fd = open(name, O_RDONLY|O_CLOEXEC)) < 0) return;
+
+    pthread_mutex_lock(&compressLock);
+    // Started by the writer thread, which has all signals blocked
+    if (!compressorRunning && pthread_create(&tid, NULL, compressor, NULL) == 0) {
+        pthread_detach(tid);
+        compressorRunning = true;
+    }
+    if (compressorRunning) {
+        compressJobs.push_back(job);
+        pthread_cond_signal(&compressWork);
+    } else {
+        close(job.fd);
+    }
+    pthread_mutex_unlock(&compressLock);
+}
+#endif /* HAVE_ZLIB */
+
+// Rotate the (closed) log file of an instance
+// <log>.<keep> is removed, the other generations are shifted by one
+void logRotate(childInstance *in)
+{
+    char from[PATH_MAX], to[PATH_MAX];
+
+    pthread_mutex_lock(&rotateLock);
+    for (int gz = 0; gz < 2; gz++) {
+        genName(to, in->logFile, logKeep, gz);
+        unlink(to);
+        for (int n = logKeep - 1; n > 0; n--) {
+            genName(from, in->logFile, n, gz);
+            genName(to, in->logFile, n + 1, gz);
+            rename(from, to);
+        }
+    }
+    genName(to, in->logFile, 1, false);
+    rename(in->logFile, to);
+    in->logRotations++;
+    count(metrics.logRotations, 1);
+    pthread_mutex_unlock(&rotateLock);
+
+#ifdef HAVE_ZLIB
+    if (logCompress && !logGzipLevel) compressLater(in);   // Not twice
+#endif
+}
@@ -0,0 +1,109 @@
+// Process server for soft ioc
+// Ralph Lange <ralph.lange@gmx.de> 2007-2019
+// GNU Public License (GPLv3) applies - see www.gnu.org
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "procServ.h"
+
+// Log time stamp cache
+// The stamp is only formatted (localtime_r + strftime) when the second
+// changes. Sub-second fields in the format (%3N: ms, %6N: us, %N or %9N:
+// ns) are not known to strftime: they are formatted as placeholders and
+// the digits are filled in on every call.
+
+#define STAMP_LEN 64
+#define MAX_SUBSEC 4
+#define SUBSEC_MARK '\001'
+
+static char   stamp[STAMP_LEN];
+static int    stampLen;
+static time_t stampSecond = -1;
+static const char *stampSource;         // stampFormat the cache was built for
+static char  *strftimeFormat;           // stampFormat with placeholders
+static int    nSubsec;                  // Number of sub-second fields
+static int    subsecPos[MAX_SUBSEC];    // Position of the fields in stamp
+static int    subsecDigits[MAX_SUBSEC];
+static int    nFields;                  // Sub-second fields in the format
+static int    fieldDigits[MAX_SUBSEC];  // and their widths, in order
+
+// Translate %<n>N fields into placeholder runs of n marker chars
+// (fields after the first MAX_SUBSEC are left to strftime)
+static void prepareFormat()
+{
+    const char *f;
+    char *o;
+    int n;
+
+    // A field of 2 chars (%N) becomes 9 marker chars: reserve 9 per char
+    free(strftimeFormat);
+    strftimeFormat = o = (char*) malloc(strlen(stampFormat) * 9 + 1);
+    nFields = 0;
+    for (f = stampFormat; *f; f++) {
+        if (f[0] == '%' && f[1] == '%') {
+            *o++ = *f++;
+            *o++ = *f;
+        } else if (f[0] == '%' && nFields < MAX_SUBSEC
+                   && (f[1] == 'N' || (f[1] >= '1' && f[1] <= '9' && f[2] == 'N'))) {
+            n = f[1] == 'N' ? 9 : f[1] - '0';
+            memset(o, SUBSEC_MARK, n);
+            o += n;
+            f += f[1] == 'N' ? 1 : 2;
+            fieldDigits[nFields++] = n;
+        } else {
+            *o++ = *f;
+        }
+    }
+    *o = '\0';
+    stampSource = stampFormat;
+    stampSecond = -1;
+}
+
+// Format the stamp for a new second, locate the sub-second fields
+static void formatSecond(time_t sec)
+{
+    struct tm now_tm;
+    int i;
+
+    localtime_r(&sec, &now_tm);
+    stampLen = strftime(stamp, sizeof(stamp)-1, strftimeFormat, &now_tm);
+    stamp[stampLen] = '\0';
+    stampSecond = sec;
+
+    // Adjacent fields make one run of markers: split it by the widths
+    nSubsec = 0;
+    for (i = 0; i < stampLen && nSubsec < nFields; i++) {
+        if (stamp[i] != SUBSEC_MARK) continue;
+        if (i + fieldDigits[nSubsec] > stampLen) break;
+        subsecPos[nSubsec] = i;
+        subsecDigits[nSubsec] = fieldDigits[nSubsec];
+        i += fieldDigits[nSubsec] - 1;
+        nSubsec++;
+    }
+}
+
+// Returns the current log time stamp (formatted with stampFormat)
+const char * logStamp(int *len)
+{
+    struct timespec now;
+    int i, j;
+
+    if (stampSource != stampFormat) prepareFormat();
+    clock_gettime(CLOCK_REALTIME, &now);
+    if (now.tv_sec != stampSecond) formatSecond(now.tv_sec);
+
+    // Fill in the sub-second digits (truncated, like date(1) does)
+    for (i = 0; i < nSubsec; i++) {
+        long frac = now.tv_nsec;
+        for (j = subsecDigits[i]; j < 9; j++) frac /= 10;
+        for (j = subsecDigits[i] - 1; j >= 0; j--) {
+            stamp[subsecPos[i] + j] = '0' + frac % 10;
+            frac /= 10;
+        }
+    }
+
+    *len = stampLen;
+    return stamp;
+}
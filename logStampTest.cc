@@ -0,0 +1,91 @@
+// Process server for soft ioc
+// Ralph Lange <ralph.lange@gmx.de> 2007-2019
+// GNU Public License (GPLv3) applies - see www.gnu.org
+
+// Checks of the log time stamp formatting (make check)
+// Best run under valgrind or built with -fsanitize=address, which also
+// catch a translated format that does not fit its buffer.
+
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "procServ.h"
+
+const char *stampFormat;
+
+static int failed;
+
+// The stamp cache is rebuilt when stampFormat changes: give each
+// format its own buffer, so no two of them can share an address
+static void setFormat(const char *fmt)
+{
+    static char formats[32][64];
+    static int next;
+
+    snprintf(formats[next], sizeof(formats[next]), "%s", fmt);
+    stampFormat = formats[next++];
+}
+
+static bool digits(const char *s, int n)
+{
+    for (int i = 0; i < n; i++)
+        if (!isdigit((unsigned char) s[i])) return false;
+    return true;
+}
+
+// Format a stamp with fmt, which must give a stamp of len chars
+// Digit fields are marked '#' in pattern, everything else has to match
+static void check(const char *fmt, const char *pattern)
+{
+    int len;
+    const char *stamp;
+
+    setFormat(fmt);
+    stamp = logStamp(&len);
+    bool ok = len == (int) strlen(pattern);
+    for (int i = 0; ok && i < len; i++) {
+        if (pattern[i] == '#') ok = digits(stamp + i, 1);
+        else ok = stamp[i] == pattern[i];
+    }
+    if (!ok) {
+        printf("FAIL: '%s' gave '%.*s', expected '%s'\n", fmt, len, stamp, pattern);
+        failed++;
+    }
+}
+
+// Two fields of one format must show the same instant
+static void checkSame(const char *fmt, int pos1, int pos2, int n)
+{
+    int len;
+    const char *stamp;
+
+    setFormat(fmt);
+    stamp = logStamp(&len);
+    if (len < pos1 + n || len < pos2 + n || memcmp(stamp + pos1, stamp + pos2, n)) {
+        printf("FAIL: '%s' gave '%.*s', fields differ\n", fmt, len, stamp);
+        failed++;
+    }
+}
+
+int main()
+{
+    // Formats made only of sub-second fields
+    check("%N", "#########");
+    check("%N ", "######### ");
+    check("%3N", "###");
+    check("%N%N", "##################");
+    check("%N%N%N%N", "####################################");
+    checkSame("%N%N", 0, 9, 9);
+    checkSame("%3N%6N", 0, 3, 3);
+    checkSame("%N|%N|%N|%N", 0, 30, 9);
+
+    // Mixed with strftime fields and escapes
+    check("[%H:%M:%S.%3N] ", "[##:##:##.###] ");
+    check("%%N %N", "%N #########");
+    check("%6N%%", "######%");
+
+    if (failed) return 1;
+    printf("logStamp: all checks passed\n");
+    return 0;
+}
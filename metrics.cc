@@ -0,0 +1,332 @@
+// Process server for soft ioc
+// Ralph Lange <ralph.lange@gmx.de> 2007-2019
+// GNU Public License (GPLv3) applies - see www.gnu.org
+
+#include <unistd.h>
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <string>
+#include <sstream>
+
+#include "procServ.h"
+#include "childInstance.h"
+#include "processClass.h"
+#include "outputQueue.h"
+#include "metrics.h"
+
+// Metrics endpoint
+// Connections to the --metrics endpoint get a snapshot of the counters
+// in Prometheus text exposition format, then they are closed.
+// An HTTP request (e.g. a Prometheus scrape) is answered after its
+// header has been read, any other client gets the plain text after
+// sending a line or closing its end (e.g. "socat - unix:<path> </dev/null").
+
+procServMetrics metrics;
+
+// Max. size of the request we wait for
+#define METRICS_REQUEST_MAX 8192
+// Max. size of the response
+#define METRICS_RESPONSE_MAX (1024*1024)
+
+class metricsItem : public connectionItem
+{
+public:
+    metricsItem(int fd);
+    ~metricsItem();
+
+    void readFromFd(void);
+    void flushToFd(void);
+    // Party line output is not for us
+    int Send(const char *buf, int len) { return 0; }
+    int Send(sharedOutput &out) { return 0; }
+
+private:
+    void respond(bool http);
+
+    std::string _request;
+    outputQueue _queue;
+    bool _responded;
+};
+
+connectionItem * metricsFactory(int fd, bool readonly, childInstance *instance)
+{
+    connectionItem *ci = new metricsItem(fd);
+    PRINTF("Created new metrics connection (metricsItem %p)\n", ci);
+    return ci;
+}
+
+metricsItem::metricsItem(int fd)
+    : connectionItem(fd, true),
+      _queue(METRICS_RESPONSE_MAX),
+      _responded(false)
+{
+    int flags = fcntl(fd, F_GETFL);
+    if (flags != -1) fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+metricsItem::~metricsItem()
+{
+    if (_fd >= 0) {
+        shutdown(_fd, SHUT_RDWR);
+        close(_fd);
+        _fd = -1;
+    }
+    PRINTF("~metricsItem()\n");
+}
+
+void metricsItem::readFromFd(void)
+{
+    char buf[1024];
+    int len;
+
+    while (-1 == (len = read(_fd, buf, sizeof(buf))) && errno == EINTR);
+    if (len < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) return;
+        markDead();
+        return;
+    }
+    if (len == 0) {                       // Client is done talking
+        pauseInput();                     // Don't get woken up by the EOF again
+        if (!_responded) respond(false);
+        if (_queue.empty()) markDead();   // Else closed by flushToFd() when drained
+        return;
+    }
+    if (_responded) return;               // Ignore anything after the request
+
+    _request.append(buf, len);
+    bool http = _request.compare(0, 4, "GET ") == 0
+             || _request.compare(0, 5, "HEAD ") == 0;
+    if (http) {
+        if (_request.find("\r\n\r\n") != std::string::npos
+                || _request.find("\n\n") != std::string::npos)
+            respond(true);
+    } else if (_request.find('\n') != std::string::npos) {
+        respond(false);
+    }
+    if (!_responded && _request.size() > METRICS_REQUEST_MAX) markDead();
+}
+
+void metricsItem::flushToFd(void)
+{
+    if (_queue.flush(_fd) < 0) {
+        _queue.clear();
+        markDead();
+    }
+    if (_queue.empty()) {
+        setWantWrite(false);
+        markDead();
+    }
+}
+
+static void counter(std::ostream& fp, const char *name, const char *help,
+                    unsigned long long value)
+{
+    fp << "# HELP " << name << " " << help << "\n"
+       << "# TYPE " << name << " counter\n"
+       << name << " " << value << "\n";
+}
+
+static void gauge(std::ostream& fp, const char *name, const char *help,
+                  long long value)
+{
+    fp << "# HELP " << name << " " << help << "\n"
+       << "# TYPE " << name << " gauge\n"
+       << name << " " << value << "\n";
+}
+
+// Per client metric: one sample for every client connection
+static void perClient(std::ostream& fp, const char *name, const char *type,
+                      const char *help, unsigned long long clientMetrics::*member)
+{
+    clientMetrics m;
+    fp << "# HELP " << name << " " << help << "\n"
+       << "# TYPE " << name << " " << type << "\n";
+    for (connectionItem *p = connectionItem::head; p; p = p->next) {
+        if (!p->getClientMetrics(m)) continue;
+        fp << name << "{id=\"" << m.id << "\",kind=\""
+           << (m.logger ? "logger" : "user") << "\"} " << m.*member << "\n";
+    }
+}
+
+// Per child metric (supervisor mode): one sample for every child instance
+static void perChild(std::ostream& fp, const char *name, const char *help,
+                     unsigned long long childMetrics::*member)
+{
+    fp << "# HELP " << name << " " << help << "\n"
+       << "# TYPE " << name << " counter\n";
+    for (childInstance *in = childInstance::head; in; in = in->next) {
+        fp << name << "{child=\"";
+        for (const char *c = in->childName; c && *c; c++) {   // Escaped label value
+            if (*c == '\\' || *c == '"') fp << '\\' << *c;
+            else if (*c == '\n') fp << "\\n";
+            else fp << *c;
+        }
+        fp << "\"} " << in->counters.*member << "\n";
+    }
+}
+
+static void writeMetrics(std::ostream& fp)
+{
+    clientMetrics m;
+    int users = 0, loggers = 0, running = 0;
+    unsigned long long queued = 0, inputQueued = 0;
+
+    for (connectionItem *p = connectionItem::head; p; p = p->next) {
+        if (!p->getClientMetrics(m)) continue;
+        if (m.logger) loggers++;
+        else users++;
+        queued += m.queued;
+    }
+    for (childInstance *in = childInstance::head; in; in = in->next) {
+        if (in->process) running++;
+        inputQueued += processClass::inputQueued(in);
+    }
+
+    gauge(fp, "procserv_start_time_seconds", "Start time of the server since the epoch.",
+          procServStart);
+    gauge(fp, "procserv_children", "Number of children (child instances) supervised.",
+          childInstance::count);
+    gauge(fp, "procserv_child_running", "Number of running children.",
+          running);
+    counter(fp, "procserv_child_starts_total", "Number of times the child was started.",
+            metrics.childStarts);
+    counter(fp, "procserv_child_exits_total", "Number of normal exits of the child.",
+            metrics.childExits);
+    counter(fp, "procserv_child_kills_total", "Number of times the child was killed by a signal.",
+            metrics.childKills);
+    gauge(fp, "procserv_child_last_exit_code", "Exit code of the last normal child exit.",
+          metrics.childLastExitCode);
+    gauge(fp, "procserv_child_last_signal", "Signal that killed the child the last time.",
+          metrics.childLastSignal);
+    if (configFile) {
+        perChild(fp, "procserv_instance_child_starts_total", "Number of times a child was started.",
+                 &childMetrics::starts);
+        perChild(fp, "procserv_instance_child_exits_total", "Number of normal exits of a child.",
+                 &childMetrics::exits);
+        perChild(fp, "procserv_instance_child_kills_total", "Number of times a child was killed by a signal.",
+                 &childMetrics::kills);
+        perChild(fp, "procserv_instance_pty_read_bytes_total", "Bytes read from a child's pty.",
+                 &childMetrics::ptyBytesRead);
+        perChild(fp, "procserv_instance_client_dropped_bytes_total", "Bytes dropped for clients of a child that did not keep up.",
+                 &childMetrics::clientBytesDropped);
+        perChild(fp, "procserv_instance_log_dropped_bytes_total", "Bytes of a child's log dropped while the log writer did not keep up.",
+                 &childMetrics::logBytesDropped);
+    }
+    counter(fp, "procserv_pty_reads_total", "Number of read calls on the child's pty.",
+            metrics.ptyReads);
+    counter(fp, "procserv_pty_read_bytes_total", "Bytes read from the child's pty.",
+            metrics.ptyBytesRead);
+    gauge(fp, "procserv_pty_input_queued_bytes", "Bytes of input waiting for the child to read them.",
+          inputQueued);
+    counter(fp, "procserv_input_pauses_total", "Number of times a client was paused while the child's input queue was full.",
+            metrics.inputPauses);
+    counter(fp, "procserv_log_writes_total", "Number of write calls to the log file.",
+            metrics.logWrites);
+    counter(fp, "procserv_log_written_bytes_total", "Bytes written to the log file.",
+            metrics.logBytesWritten);
+    counter(fp, "procserv_log_fsyncs_total", "Number of fsync calls on the log file.",
+            metrics.logFsyncs);
+    counter(fp, "procserv_log_dropped_bytes_total", "Bytes dropped while the log writer did not keep up.",
+            metrics.logBytesDropped);
+    counter(fp, "procserv_log_blocked_total", "Number of times the main loop waited for the log writer.",
+            metrics.logBlocked);
+    counter(fp, "procserv_log_rotations_total", "Number of log file rotations.",
+            metrics.logRotations);
+    counter(fp, "procserv_log_compressions_total", "Number of rotated log files compressed.",
+            metrics.logCompressions);
+    counter(fp, "procserv_log_deflated_bytes_total", "Bytes of log output compressed before writing.",
+            metrics.logBytesDeflated);
+    counter(fp, "procserv_log_frames_total", "Number of compressed log frames finished.",
+            metrics.logFrames);
+    gauge(fp, "procserv_log_queued_bytes", "Bytes waiting for the log writer.",
+          logQueuedBytes());
+
+    counter(fp, "procserv_accept_wakeups_total", "Number of times a listener was ready to accept.",
+            metrics.acceptWakeups);
+    counter(fp, "procserv_accepted_total", "Number of connections accepted on all listeners.",
+            metrics.acceptedConnections);
+    counter(fp, "procserv_accept_errors_total", "Number of failed accept calls.",
+            metrics.acceptErrors);
+    counter(fp, "procserv_accept_batch_full_total", "Number of times a listener accepted the max. batch in one go.",
+            metrics.acceptBatchFull);
+    gauge(fp, "procserv_accept_batch_max", "Largest number of connections accepted in one go.",
+          metrics.acceptBatchMax);
+
+    fp << "# HELP procserv_clients_accepted_total Number of accepted client connections.\n"
+       << "# TYPE procserv_clients_accepted_total counter\n"
+       << "procserv_clients_accepted_total{kind=\"user\"} " << metrics.accepted[0] << "\n"
+       << "procserv_clients_accepted_total{kind=\"logger\"} " << metrics.accepted[1] << "\n";
+    fp << "# HELP procserv_clients_closed_total Number of closed client connections.\n"
+       << "# TYPE procserv_clients_closed_total counter\n"
+       << "procserv_clients_closed_total{kind=\"user\"} " << metrics.closed[0] << "\n"
+       << "procserv_clients_closed_total{kind=\"logger\"} " << metrics.closed[1] << "\n";
+    fp << "# HELP procserv_clients_rejected_total Number of client connections turned away by the connection limits.\n"
+       << "# TYPE procserv_clients_rejected_total counter\n"
+       << "procserv_clients_rejected_total{reason=\"max-clients\"} " << metrics.rejected[0] << "\n"
+       << "procserv_clients_rejected_total{reason=\"max-loggers\"} " << metrics.rejected[1] << "\n"
+       << "procserv_clients_rejected_total{reason=\"max-per-source\"} " << metrics.rejectedPerSource << "\n";
+    fp << "# HELP procserv_clients Number of connected clients.\n"
+       << "# TYPE procserv_clients gauge\n"
+       << "procserv_clients{kind=\"user\"} " << users << "\n"
+       << "procserv_clients{kind=\"logger\"} " << loggers << "\n";
+
+    counter(fp, "procserv_client_writes_total", "Number of write calls to clients.",
+            metrics.clientWrites);
+    counter(fp, "procserv_client_sent_bytes_total", "Bytes sent to clients.",
+            metrics.clientBytesSent);
+    counter(fp, "procserv_client_dropped_bytes_total", "Bytes dropped for clients that did not keep up.",
+            metrics.clientBytesDropped);
+    counter(fp, "procserv_client_overflows_total", "Number of client output queue overflows.",
+            metrics.clientOverflows);
+    counter(fp, "procserv_client_blocks_total", "Number of times the child's output was held for a client that did not keep up.",
+            metrics.clientBlocks);
+    gauge(fp, "procserv_client_queued_bytes", "Bytes waiting in all client output queues.",
+          queued);
+
+    perClient(fp, "procserv_connection_sent_bytes_total", "counter",
+              "Bytes sent to a client connection.", &clientMetrics::bytesSent);
+    perClient(fp, "procserv_connection_writes_total", "counter",
+              "Number of write calls to a client connection.", &clientMetrics::writes);
+    perClient(fp, "procserv_connection_dropped_bytes_total", "counter",
+              "Bytes dropped for a client connection.", &clientMetrics::bytesDropped);
+    perClient(fp, "procserv_connection_overflows_total", "counter",
+              "Number of output queue overflows of a client connection.", &clientMetrics::overflows);
+
+    fp << "# HELP procserv_connection_queued_bytes Bytes waiting in the output queue of a client connection.\n"
+       << "# TYPE procserv_connection_queued_bytes gauge\n";
+    for (connectionItem *p = connectionItem::head; p; p = p->next) {
+        if (!p->getClientMetrics(m)) continue;
+        fp << "procserv_connection_queued_bytes{id=\"" << m.id << "\",kind=\""
+           << (m.logger ? "logger" : "user") << "\"} " << m.queued << "\n";
+    }
+}
+
+void metricsItem::respond(bool http)
+{
+    std::ostringstream body;
+    std::string out;
+
+    _responded = true;
+    writeMetrics(body);
+    if (http) {
+        std::ostringstream head;
+        head << "HTTP/1.0 200 OK\r\n"
+             << "Content-Type: text/plain; version=0.0.4\r\n"
+             << "Content-Length: " << body.str().size() << "\r\n"
+             << "Connection: close\r\n\r\n";
+        out = head.str();
+        if (_request.compare(0, 5, "HEAD ") != 0) out += body.str();
+    } else {
+        out = body.str();
+    }
+
+    if (!_queue.push(out.data(), out.size())) {
+        markDead();
+        return;
+    }
+    setWantWrite(true);
+    flushToFd();
+}
@@ -0,0 +1,80 @@
+// Process server for soft ioc
+// Ralph Lange <ralph.lange@gmx.de> 2007-2019
+// GNU Public License (GPLv3) applies - see www.gnu.org
+
+
+#ifndef metricsH
+#define metricsH
+
+#include <stddef.h>
+
+// Server wide counters
+// Plain integer increments, cheap enough to be always on
+struct procServMetrics
+{
+    unsigned long long ptyReads;          // read() calls on the child's pty
+    unsigned long long ptyBytesRead;
+    unsigned long long clientWrites;      // write() / writev() calls to clients
+    unsigned long long clientBytesSent;
+    unsigned long long clientBytesDropped;
+    unsigned long long clientOverflows;   // Client output queue overflows
+    unsigned long long clientBlocks;      // Child output held for a client (policy "block")
+    unsigned long long inputPauses;       // Clients paused while the child's input queue is full
+    unsigned long long logWrites;         // write() calls to the log file
+    unsigned long long logBytesWritten;
+    unsigned long long logFsyncs;
+    unsigned long long logBytesDropped;   // Log data dropped (--log-overflow drop)
+    unsigned long long logBlocked;        // Main loop waited for the log writer thread
+    unsigned long long logRotations;      // Log files rotated (--log-rotate-size, --log-rotate-interval)
+    unsigned long long logCompressions;   // Rotated log files gzipped (--log-compress)
+    unsigned long long logBytesDeflated;  // Log data compressed (--log-gzip)
+    unsigned long long logFrames;         // Compressed frames finished (--log-gzip)
+    unsigned long long childStarts;
+    unsigned long long childExits;        // Normal exits of the child
+    unsigned long long childKills;        // Child killed by a signal
+    int childLastExitCode;
+    int childLastSignal;
+    unsigned long long accepted[2];       // Client connections [user, logger]
+    unsigned long long acceptWakeups;     // Listener wakeups (accept batches)
+    unsigned long long acceptedConnections; // Connections accepted on all listeners
+    unsigned long long acceptErrors;
+    unsigned long long acceptBatchFull;   // Batches that hit ACCEPT_BATCH
+    unsigned acceptBatchMax;              // Largest number accepted in one batch
+    unsigned long long rejected[2];       // Over --max-clients, --max-loggers [user, logger]
+    unsigned long long rejectedPerSource; // Over --max-per-source
+    unsigned long long closed[2];
+};
+
+extern procServMetrics metrics;
+
+// For counters that other threads (log writer, compressor) update
+static inline void count(unsigned long long &counter, unsigned long long n)
+{
+    __atomic_fetch_add(&counter, n, __ATOMIC_RELAXED);
+}
+
+// Counters of a single child instance
+// (labelled with the child's name in supervisor mode)
+struct childMetrics
+{
+    unsigned long long starts;
+    unsigned long long exits;             // Normal exits
+    unsigned long long kills;             // Killed by a signal
+    unsigned long long ptyBytesRead;
+    unsigned long long clientBytesDropped;  // For clients that did not keep up
+    unsigned long long logBytesDropped;   // --log-overflow drop
+};
+
+// Counters of a single client connection
+struct clientMetrics
+{
+    unsigned long id;                     // Connection number
+    bool logger;
+    unsigned long long writes;
+    unsigned long long bytesSent;
+    unsigned long long bytesDropped;
+    unsigned long long overflows;         // Output queue overflows
+    size_t queued;                        // Bytes waiting in the output queue
+};
+
+#endif /* #ifndef metricsH */
@@ -0,0 +1,282 @@
+// Process server for soft ioc
+// Ralph Lange <ralph.lange@gmx.de> 2007-2019
+// GNU Public License (GPLv3) applies - see www.gnu.org
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <new>
+#include <sys/uio.h>
+
+#include "outputQueue.h"
+#include "libtelnet.h"
+
+// Small writes (e.g. telnet negotiation) are collected in chunks of this size
+#define MIN_CHUNK_SIZE 4096
+// Max. number of iovecs handed to writev()
+#define MAX_IOV 64
+
+outputChunk * outputChunk::create(size_t capacity)
+{
+    void *mem = malloc(sizeof(outputChunk) + capacity);
+    if (!mem) throw std::bad_alloc();
+    outputChunk *c = new (mem) outputChunk;
+    c->_refs = 1;
+    c->_size = 0;
+    c->_capacity = capacity;
+    return c;
+}
+
+outputChunk * outputChunk::create(const char *buf, size_t len)
+{
+    outputChunk *c = create(len);
+    c->append(buf, len);
+    return c;
+}
+
+void outputChunk::unref()
+{
+    if (--_refs == 0) free(this);
+}
+
+void outputChunk::append(const char *buf, size_t len)
+{
+    memcpy(_data + _size, buf, len);
+    _size += len;
+}
+
+outputQueue::outputQueue(size_t limit)
+    : _bytes(0), _extra(0), _limit(limit)
+{}
+
+outputQueue::~outputQueue()
+{
+    clear();
+}
+
+bool outputQueue::push(const char *buf, size_t len)
+{
+    if (len == 0) return true;
+    if (used() + len > _limit) return false;
+
+    // Top up the last chunk if it is ours alone
+    if (!_q.empty() && !_q.back().extra) {
+        outputChunk *last = _q.back().chunk;
+        if (!last->shared() && last->room() >= len) {
+            last->append(buf, len);
+            _bytes += len;
+            return true;
+        }
+    }
+
+    outputChunk *c = outputChunk::create(len > MIN_CHUNK_SIZE ? len : MIN_CHUNK_SIZE);
+    c->append(buf, len);
+    entry e = { c, 0, 0, false };
+    _q.push_back(e);
+    _bytes += len;
+    return true;
+}
+
+bool outputQueue::push(outputChunk *chunk, size_t offset, bool overLimit)
+{
+    size_t len = chunk->size() - offset;
+
+    if (len == 0) return true;
+    if (used() + len > _limit && !overLimit) return false;
+
+    chunk->ref();
+    entry e = { chunk, offset, 0, false };
+    _q.push_back(e);
+    _bytes += len;
+    return true;
+}
+
+void outputQueue::pushExtra(outputChunk *chunk)
+{
+    if (chunk->size() == 0) return;
+    chunk->ref();
+    entry e = { chunk, 0, 0, true };
+    _q.push_back(e);
+    _bytes += chunk->size();
+    _extra += chunk->size();
+}
+
+size_t outputQueue::pushDropOldest(outputChunk *chunk)
+{
+    size_t len = chunk->size(), dropped = 0;
+    char marker[64];
+
+    if (push(chunk)) return 0;
+
+    // Drop from the second entry on, merging earlier markers
+    while (_q.size() > 1 && used() + len > _limit) {
+        entry &e = _q[1];
+        size_t size = e.chunk->size() - e.offset;
+        dropped += e.dropped ? e.dropped : size;
+        _bytes -= size;
+        if (e.extra) _extra -= size;
+        e.chunk->unref();
+        _q.erase(_q.begin() + 1);
+    }
+    if (!push(chunk)) dropped += len;
+
+    int n = snprintf(marker, sizeof(marker), "\r\n@@@ %lu bytes dropped\r\n",
+                     (unsigned long) dropped);
+    entry e = { outputChunk::create(marker, n), 0, dropped, false };
+    _q.insert(_q.empty() ? _q.begin() : _q.begin() + 1, e);  // Where the data was lost
+    _bytes += n;
+    return dropped;
+}
+
+int outputQueue::flush(int fd)
+{
+    struct iovec iov[MAX_IOV];
+    int n = 0;
+    ssize_t status;
+
+    for (std::deque<entry>::iterator it = _q.begin(); it != _q.end() && n < MAX_IOV; ++it, ++n) {
+        iov[n].iov_base = it->chunk->data() + it->offset;
+        iov[n].iov_len  = it->chunk->size() - it->offset;
+    }
+    if (n == 0) return 0;
+
+    while (-1 == (status = writev(fd, iov, n)) && errno == EINTR);
+    if (status < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+        return -1;
+    }
+
+    size_t left = status;
+    _bytes -= left;
+    while (left) {
+        entry &e = _q.front();
+        size_t avail = e.chunk->size() - e.offset;
+        if (left < avail) {
+            e.offset += left;
+            if (e.extra) _extra -= left;
+            break;
+        }
+        left -= avail;
+        if (e.extra) _extra -= avail;
+        e.chunk->unref();
+        _q.pop_front();
+    }
+    return status;
+}
+
+void outputQueue::clear()
+{
+    while (!_q.empty()) {
+        _q.front().chunk->unref();
+        _q.pop_front();
+    }
+    _bytes = 0;
+    _extra = 0;
+}
+
+// Size of a buffer after escaping telnet IAC bytes
+size_t outputChunk::escapedSize(const char *buf, size_t len)
+{
+    size_t n = len;
+    const char *end = buf + len;
+    while ((buf = (const char *) memchr(buf, TELNET_IAC, end - buf))) {
+        n++;
+        buf++;
+    }
+    return n;
+}
+
+// Append a buffer to a chunk, doubling IAC bytes like telnet_send() does
+void outputChunk::appendEscaped(const char *buf, size_t len)
+{
+    const char *end = buf + len;
+    const char *iac;
+    while ((iac = (const char *) memchr(buf, TELNET_IAC, end - buf))) {
+        append(buf, iac - buf + 1);
+        append(iac, 1);
+        buf = iac + 1;
+    }
+    append(buf, end - buf);
+}
+
+size_t stampLines(const char *message, size_t count,
+                  const char *stamp, size_t stamp_len,
+                  bool &lineStart, std::vector<struct iovec> &iov)
+{
+    const char *p = message, *end = message + count, *nl, *eol;
+    struct iovec v;
+    size_t stamps = 0;
+
+    iov.clear();
+    while (p < end) {
+        if (lineStart) {
+            v.iov_base = (void *) stamp;
+            v.iov_len = stamp_len;
+            iov.push_back(v);
+            stamps++;
+        }
+        nl = (const char *) memchr(p, '\n', end - p);
+        eol = nl ? nl + 1 : end;
+        v.iov_base = (void *) p;
+        v.iov_len = eol - p;
+        iov.push_back(v);
+        lineStart = nl != NULL;
+        p = eol;
+    }
+    return stamps;
+}
+
+sharedOutput::sharedOutput(const char *message, int count,
+                           const char *stamp, int stamp_len)
+    : message(message), count(count), stamp(stamp), stamp_len(stamp_len),
+      _plain(NULL), _stamped(NULL), _stamp(NULL)
+{}
+
+sharedOutput::~sharedOutput()
+{
+    if (_plain) _plain->unref();
+    if (_stamped) _stamped->unref();
+    if (_stamp) _stamp->unref();
+}
+
+outputChunk * sharedOutput::plain()
+{
+    if (!_plain) {
+        _plain = outputChunk::create(outputChunk::escapedSize(message, count));
+        _plain->appendEscaped(message, count);
+    }
+    return _plain;
+}
+
+outputChunk * sharedOutput::stampChunk()
+{
+    if (!_stamp) {
+        _stamp = outputChunk::create(outputChunk::escapedSize(stamp, stamp_len));
+        _stamp->appendEscaped(stamp, stamp_len);
+    }
+    return _stamp;
+}
+
+outputChunk * sharedOutput::stamped()
+{
+    if (!_stamped) {
+        static std::vector<struct iovec> iov;
+        // Stamps go before the first char of a line, i.e. after every
+        // newline that is not the last char (the first stamp is separate)
+        bool lineStart = false;
+        size_t stamps = stampLines(message, count, stamp, stamp_len, lineStart, iov);
+
+        _stamped = outputChunk::create(outputChunk::escapedSize(message, count)
+                                       + stamps * stampChunk()->size());
+        for (size_t i = 0; i < iov.size(); i++) {
+            if (iov[i].iov_base == stamp)
+                _stamped->append(_stamp->data(), _stamp->size());
+            else
+                _stamped->appendEscaped((const char *) iov[i].iov_base, iov[i].iov_len);
+        }
+    }
+    return _stamped;
+}
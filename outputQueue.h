@@ -0,0 +1,146 @@
+// Process server for soft ioc
+// Ralph Lange <ralph.lange@gmx.de> 2007-2019
+// GNU Public License (GPLv3) applies - see www.gnu.org
+
+
+#ifndef outputQueueH
+#define outputQueueH
+
+#include <deque>
+#include <vector>
+#include <stddef.h>
+#include <sys/uio.h>
+
+// outputChunk class definition
+// A reference counted block of output data.
+// Once it has been queued, the data must not change.
+class outputChunk
+{
+public:
+    static outputChunk * create(size_t capacity);
+    static outputChunk * create(const char *buf, size_t len);
+
+    void ref() { _refs++; }
+    void unref();
+
+    char * data() { return _data; }
+    const char * data() const { return _data; }
+    size_t size() const { return _size; }
+    size_t capacity() const { return _capacity; }
+    size_t room() const { return _capacity - _size; }
+    bool shared() const { return _refs > 1; }
+
+    // Append to a chunk that is not shared (yet)
+    void append(const char *buf, size_t len);
+    // Same, doubling telnet IAC bytes like telnet_send() does
+    void appendEscaped(const char *buf, size_t len);
+    // Size of a buffer after escaping telnet IAC bytes
+    static size_t escapedSize(const char *buf, size_t len);
+
+private:
+    outputChunk() {}
+    size_t _refs;
+    size_t _size;
+    size_t _capacity;
+    char _data[1];
+};
+
+// outputQueue class definition
+// Bounded queue of output data waiting for a (non-blocking) fd to
+// become writable.
+class outputQueue
+{
+public:
+    outputQueue(size_t limit);
+    ~outputQueue();
+
+    bool empty() const { return _q.empty(); }
+    size_t bytes() const { return _bytes; }
+    size_t limit() const { return _limit; }
+    // Bytes counted against the limit (all but the extra data)
+    size_t used() const { return _bytes - _extra; }
+
+    // Copy data into the queue
+    // Returns false (and queues nothing) if that would exceed the limit
+    bool push(const char *buf, size_t len);
+
+    // Queue a reference to a chunk, starting at offset
+    // Returns false (and queues nothing) if that would exceed the limit,
+    // unless overLimit is set
+    bool push(outputChunk *chunk, size_t offset = 0, bool overLimit = false);
+
+    // Queue a reference to a chunk of one-time extra data (e.g. the
+    // scrollback replay) that is not counted against the limit: it
+    // does not take room from the data queued after it
+    void pushExtra(outputChunk *chunk);
+
+    // Queue a reference to a chunk, dropping the oldest data if it does
+    // not fit: the entries after the first one (which may be partially
+    // written, the telnet stream must stay intact) are dropped until it
+    // fits, if it still does not fit it is dropped itself. A marker
+    // "@@@ N bytes dropped" takes the place of the lost data (markers of
+    // earlier drops are merged into it).
+    // Returns the number of bytes dropped (0: queued without loss)
+    size_t pushDropOldest(outputChunk *chunk);
+
+    // Write as much as possible using one writev() call
+    // Returns the number of bytes written, -1 on error (see errno)
+    int flush(int fd);
+
+    void clear();
+
+private:
+    struct entry {
+        outputChunk *chunk;
+        size_t offset;       // Bytes of this chunk already written
+        size_t dropped;      // Drop marker: number of bytes it reports
+        bool extra;          // Not counted against the limit
+    };
+    std::deque<entry> _q;
+    size_t _bytes;
+    size_t _extra;           // Bytes of extra data in _bytes
+    size_t _limit;
+};
+
+// Stamping engine
+// Splits message into lines (using memchr) and fills iov with the line
+// fragments, with a reference to stamp before the first char of every line.
+// lineStart tells if the message starts a new line (gets a stamp first);
+// on return, it tells if the next message will start a new line.
+// Returns the number of stamps inserted.
+size_t stampLines(const char *message, size_t count,
+                  const char *stamp, size_t stamp_len,
+                  bool &lineStart, std::vector<struct iovec> &iov);
+
+// sharedOutput class definition
+// Output on its way to all clients (party line).
+// The telnet encoded representations are created once, on first use,
+// and shared by all clients of the same kind (user, time stamped logger).
+class sharedOutput
+{
+public:
+    sharedOutput(const char *message, int count,
+                 const char *stamp = NULL, int stamp_len = 0);
+    ~sharedOutput();
+
+    const char *message;
+    int count;
+    const char *stamp;       // NULL: no time stamping
+    int stamp_len;
+
+    // Telnet encoded message
+    outputChunk * plain();
+    // Telnet encoded message, with a time stamp after every inner newline
+    outputChunk * stamped();
+    // Telnet encoded time stamp (for the first line)
+    outputChunk * stampChunk();
+    // True if the message ends with a newline (next one starts a line)
+    bool endsLine() const { return count > 0 && message[count-1] == '\n'; }
+
+private:
+    outputChunk *_plain;
+    outputChunk *_stamped;
+    outputChunk *_stamp;
+};
+
+#endif /* #ifndef outputQueueH */
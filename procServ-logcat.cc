@@ -0,0 +1,245 @@
+// Process server for soft ioc
+// Ralph Lange <ralph.lange@gmx.de> 2007-2019
+// GNU Public License (GPLv3) applies - see www.gnu.org
+
+// procServ-logcat: print log files written with procServ --log-gzip
+//
+// Such a file is a series of gzip members (frames). Unlike zcat, this
+// - passes uncompressed parts through (e.g. output logged before
+//   --log-gzip was used),
+// - prints what can be decoded of a frame that is incomplete because
+//   procServ is still writing it or crashed (procServ flushes the
+//   compressor before every fsync, so a frame that was cut off there is
+//   followed directly by the next one),
+// - skips damaged frames and goes on with the next one.
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <zlib.h>
+
+#define BUFLEN (64*1024)
+
+static const char *progName = "procServ-logcat";
+static bool quiet;
+
+// Input file with a buffer that can be refilled while keeping
+// the unused rest
+class logInput
+{
+public:
+    logInput(int fd) : _fd(fd), _pos(0), _end(0), _done(0), _eof(false) {}
+    unsigned char *data() { return _buf + _pos; }
+    size_t avail() const { return _end - _pos; }
+    bool eof() const { return _eof; }
+    unsigned long long offset() const { return _done + _pos; }
+    void consume(size_t n) { _pos += n; }
+    // Read more; returns false at the end of the file
+    bool fill() {
+        ssize_t n;
+        if (_eof) return false;
+        if (_pos) {
+            memmove(_buf, _buf + _pos, _end - _pos);
+            _done += _pos;
+            _end -= _pos;
+            _pos = 0;
+        }
+        if (_end == sizeof(_buf)) return true;
+        while ((n = read(_fd, _buf + _end, sizeof(_buf) - _end)) < 0 && errno == EINTR);
+        if (n <= 0) {
+            if (n < 0) fprintf(stderr, "%s: read error: %s\n", progName, strerror(errno));
+            _eof = true;
+            return false;
+        }
+        _end += n;
+        return true;
+    }
+private:
+    int _fd;
+    size_t _pos, _end;
+    unsigned long long _done;       // Bytes dropped from the buffer
+    bool _eof;
+    unsigned char _buf[BUFLEN];
+};
+
+static void output(const void *buf, size_t len)
+{
+    if (len && fwrite(buf, 1, len, stdout) != len) {
+        fprintf(stderr, "%s: write error: %s\n", progName, strerror(errno));
+        exit(1);
+    }
+}
+
+// Offset of the next gzip header in buf, len if there is none
+// (a partial header at the end counts as one)
+static size_t findFrame(const unsigned char *buf, size_t len)
+{
+    for (size_t i = 0; i < len; i++) {
+        if (buf[i] != 0x1f) continue;
+        if (i + 1 < len && buf[i + 1] != 0x8b) continue;
+        if (i + 2 < len && buf[i + 2] != Z_DEFLATED) continue;
+        return i;
+    }
+    return len;
+}
+
+// End of a sync flush (empty stored block) followed by a gzip header:
+// a frame that was cut off, and the next one
+static const unsigned char cutOff[] = { 0x00, 0x00, 0xff, 0xff, 0x1f, 0x8b, Z_DEFLATED };
+#define SYNC_LEN 4
+
+// Offset of the first cut off frame end in buf, len if there is none
+static size_t findCutOff(const unsigned char *buf, size_t len)
+{
+    const unsigned char *p = buf, *end = buf + len;
+
+    while ((p = (const unsigned char *) memchr(p, 0xff, end - p))) {
+        if (p - buf >= 3 && (size_t) (end - p) >= sizeof(cutOff) - 3
+                && memcmp(p - 3, cutOff, sizeof(cutOff)) == 0)
+            return p - 3 - buf + SYNC_LEN;
+        p++;
+    }
+    return len;
+}
+
+// Decode one frame, which starts at the current input position
+// Returns false if it is damaged
+static bool decodeFrame(const char *name, logInput &in, z_stream *zs)
+{
+    static unsigned char out[BUFLEN];
+    unsigned long long start = in.offset();
+    int status = Z_OK;
+
+    inflateReset(zs);
+    while (status != Z_STREAM_END) {
+        // Keep enough input to recognize a cut off frame end
+        while (in.avail() < sizeof(cutOff) && in.fill());
+        if (!in.avail()) {
+            if (!quiet)
+                fprintf(stderr, "%s: %s: incomplete frame at offset %llu"
+                        " (still being written?)\n", progName, name, start);
+            return true;
+        }
+        size_t len = findCutOff(in.data(), in.avail());
+        bool cut = len < in.avail();
+        if (!cut && !in.eof()) len = in.avail() - sizeof(cutOff) + 1;
+        zs->next_in = in.data();
+        zs->avail_in = len;
+        do {
+            zs->next_out = out;
+            zs->avail_out = sizeof(out);
+            status = inflate(zs, Z_NO_FLUSH);
+            output(out, sizeof(out) - zs->avail_out);
+        } while (status == Z_OK && zs->avail_out == 0);
+        in.consume(len - zs->avail_in);
+        if (status == Z_BUF_ERROR) status = Z_OK;       // Needs more input
+        if (cut && status == Z_OK && !zs->avail_in && (zs->data_type & 128)) {
+            if (!quiet)
+                fprintf(stderr, "%s: %s: incomplete frame at offset %llu"
+                        " (procServ stopped while writing it)\n", progName, name, start);
+            return true;
+        }
+        if (status != Z_OK && status != Z_STREAM_END) {
+            fprintf(stderr, "%s: %s: damaged frame at offset %llu (%s), skipped\n",
+                    progName, name, start, zs->msg ? zs->msg : "error");
+            return false;
+        }
+    }
+    return true;
+}
+
+// Print a log file
+// Returns false if it has damaged parts
+static bool logcat(const char *name, int fd)
+{
+    logInput in(fd);
+    z_stream zs;
+    bool ok = true, skip = false;
+
+    memset(&zs, 0, sizeof(zs));
+    if (inflateInit2(&zs, 15 + 16) != Z_OK) {
+        fprintf(stderr, "%s: zlib initialization failed\n", progName);
+        exit(1);
+    }
+    for (;;) {
+        if (in.avail() < 3 && !in.eof()) in.fill();
+        if (!in.avail()) break;
+
+        size_t n = findFrame(in.data(), in.avail());
+        if (n == 0 && (in.avail() >= 3 || in.eof())) {
+            if (in.avail() < 3) {               // Not a frame after all
+                output(in.data(), in.avail());
+                in.consume(in.avail());
+                continue;
+            }
+            skip = false;
+            if (!decodeFrame(name, in, &zs)) {
+                ok = false;
+                skip = true;                    // Up to the next frame
+                in.consume(1);
+            }
+            continue;
+        }
+        if (n == 0) {                           // Partial header, need more
+            in.fill();
+            continue;
+        }
+        if (!skip) output(in.data(), n);        // Plain text
+        in.consume(n);
+    }
+    inflateEnd(&zs);
+    return ok;
+}
+
+static void usage(FILE *fp)
+{
+    fprintf(fp, "Usage: %s [-q] [<file> ...]\n"
+            "Print log files written by procServ --log-gzip ('-' or none: stdin)\n"
+            " -q  do not report incomplete frames\n"
+            " -h  print this help\n", progName);
+}
+
+int main(int argc, char *argv[])
+{
+    int c, fd;
+    bool ok = true;
+
+    while ((c = getopt(argc, argv, "hq")) != -1) {
+        switch (c) {
+        case 'q':
+            quiet = true;
+            break;
+        case 'h':
+            usage(stdout);
+            return 0;
+        default:
+            usage(stderr);
+            return 1;
+        }
+    }
+
+    if (optind == argc) return logcat("stdin", 0) ? 0 : 1;
+
+    for (; optind < argc; optind++) {
+        const char *name = argv[optind];
+        if (strcmp(name, "-") == 0) {
+            ok &= logcat("stdin", 0);
+            continue;
+        }
+        if ((fd = open(name, O_RDONLY)) < 0) {
+            fprintf(stderr, "%s: %s: %s\n", progName, name, strerror(errno));
+            ok = false;
+            continue;
+        }
+        ok &= logcat(name, fd);
+        close(fd);
+    }
+    return ok ? 0 : 1;
+}
@@ -27,7 +27,6 @@
 #include <unistd.h> 
 #include <termios.h>
 #include <sys/ioctl.h>
-#include <sys/select.h>
 #include <string.h>
 
 #ifdef __CYGWIN__
@@ -35,6 +34,10 @@
 #endif /* __CYGWIN__ */
 
 #include "procServ.h"
+#include "childInstance.h"
+#include "eventLoop.h"
+#include "metrics.h"
+#include "outputQueue.h"
 
 // Wrapper to ignore return values
 template<typename T>
@@ -50,29 +53,13 @@ bool   inDebugMode;              // This enables a lot of printfs
 bool   inFgMode = false;         // This keeps child in the foreground, tty connected
 bool   logPortLocal;             // This restricts log port access to localhost
 bool   ctlPortLocal = true;      // Restrict control connections to localhost
-bool   waitForManualStart = false;  // Waits for telnet cmd to manually start child
 volatile bool shutdownServer = false;   // To keep the server from shutting down
 bool   quiet = false;            // Suppress info output (server)
-bool   setCoreSize = false;      // Set core size for child
 bool   singleEndpointStyle = true;  // Compatibility style: first non-option is endpoint
-RestartMode restartMode = restart;  // Child restart mode (restart/norestart/oneshot)
-bool   firstRun;                 // Has process run for purposes of oneshot restart mode
 char   *procservName;            // The name of this beast (server)
-char   *childName;               // The name of that beast (child)
-char   *childExec;               // Exec to run as child
-char   **childArgv;              // Argv for child process
 int    connectionNo;             // Total number of connections
-char   *ignChars = NULL;         // Characters to ignore
-char   killChar = 0x18;          // Kill command character (default: ^X)
-char   toggleRestartChar = 0x14; // Toggle autorestart character (default: ^T)
-char   restartChar = 0x12;       // Restart character (default: ^R)
-char   quitChar = 0x11;          // Quit character (default: ^Q)
-char   logoutChar = 0x00;        // Logout client connection character (default: none)
-int    killSig = SIGKILL;        // Kill signal (default: SIGKILL)
-rlim_t coreSize;                 // Max core size for child
-char   *chDir;                   // Directory to change to before starting child
 char   *myDir;                   // Directory where server was started
-time_t holdoffTime = 15;         // Holdoff time between child restarts (in seconds)
+char   *configFile;              // Supervisor mode: children are described in this file
 int    childExitCode = 0;        // Child's exit code
 
 pid_t  procservPid;              // PID of server (daemon if not in debug mode)
@@ -82,29 +69,28 @@ char   defaulttimeFormat[] = "%c";    // default
 bool   stampLog = false;         // Prefix log lines with time stamp
 const char *stampFormat;             // Log time stamp format string
 
-const size_t INFO1LEN = 512;
-const size_t INFO2LEN = 128;
-const size_t INFO3LEN = 128;
-
-char   infoMessage1[INFO1LEN];   // Sign on message: server PID, child pwd and command line
-char   infoMessage2[INFO2LEN];   // Sign on message: child PID
-char   infoMessage3[INFO3LEN];   // Sign on message: available server commands
+#define MAX_CONNECTIONS 64
 
-char   *logFile = NULL;          // File name for log
-int    logFileFD=-1;             // FD for log file
-char  *logPort;                  // address for logger connections
+char  *metricsPort;              // address for metrics readers
 int    debugFD=-1;               // FD for debug output
+int    listenBacklog = 128;      // Length of the pending connections queue of endpoints
+int    maxClients = MAX_CONNECTIONS;  // Max. number of control connections (0: no limit)
+int    maxLoggers = MAX_CONNECTIONS;  // Max. number of log connections (0: no limit)
+int    maxPerSource;             // Max. connections from one address / uid (0: no limit)
 
-#define MAX_CONNECTIONS 64
+static eventLoop *evLoop;        // Waits for and dispatches connection activity
 
 // mLoop runs the program
 void mLoop();
 // Handles houskeeping
 void OnPollTimeout();
+// Collects exited children
+void reapChildren();
 // Daemonizes the program
 void forkAndGo();
-void openLogFile();
-void setEnvVar();
+void setEnvVar(childInstance *in);
+void setupMessages(childInstance *in);
+static bool allFinished();
 void writeInfoFile(const std::string& infofile);
 void ttySetCharNoEcho(bool save);
 
@@ -112,11 +98,13 @@ void ttySetCharNoEcho(bool save);
 static void OnSigPipe(int);
 static void OnSigTerm(int);
 static void OnSigHup(int);
+static void OnSigChld(int);
 
 // Flags used for communication between sig handler and main()
 static volatile sig_atomic_t sigPipeSet;
 static volatile sig_atomic_t sigTermSet;
 static volatile sig_atomic_t sigHupSet;
+static volatile sig_atomic_t sigChldSet;
 
 void writePidFile(int pid)
 {
@@ -151,11 +139,32 @@ char getOptionChar ( const char* buf )
     }
 }
 
+char * getIgnoreChars ( const char* buf )
+{
+    unsigned int i, j;
+    char *chars = (char*) calloc( strlen(buf) + 1, 1 );
+
+    i = j = 0;          // ^ escapes (CTRL)
+    while ( i <= strlen(buf) ) {
+        if ( buf[i] == '^' && buf[i+1] == '^' ) {
+            chars[j++] = '^';
+            i += 2 ;
+        } else if ( buf[i] == '^' && buf[i+1] >= 'A' && buf[i+1] <= 'Z' ) {
+            chars[j++] = buf[i+1] - 64;
+            i += 2;
+        } else {
+            chars[j++] = buf[i++];
+        }
+    }
+    return chars;
+}
+
 void printUsage()
 {
     printf("Usage: %s [options] -P <endpoint>... <command args ...>    (-h for help)\n"
-           "       %s [options] <endpoint> <command args ...>\n",
-           procservName, procservName);
+           "       %s [options] <endpoint> <command args ...>\n"
+           "       %s [options] --config <file>\n",
+           procservName, procservName, procservName);
 }
 
 void printHelp()
@@ -165,12 +174,16 @@ void printHelp()
            "    <port>           TCP <port> on local/all interfaces (see --allow/--restrict)\n"
            "    <iface>:<port>   TCP <port> on specific IP <iface> (numeric)\n"
            "    unix:<path>      UNIX domain socket at <path> (@... for abstract)\n"
+           "    <endpoint>,backlog=<n>  same, overriding --backlog\n"
            "<command args ...>   command line to start child process\n"
            "Options:\n"
            "    --allow               allow control connections from anywhere\n"
            "    --autorestartcmd      command to toggle auto restart flag (^ for ctrl)\n"
+           "    --backlog <n>         queue up to <n> pending connections per endpoint\n"
            "    --coresize <n>        set maximum core size for child to <n>\n"
            " -c --chdir <dir>         change directory to <dir> before starting child\n"
+           "    --client-queue <n>    queue up to <n> bytes of output per client [k|M]\n"
+           "    --config <file>       supervise all children described in <file>\n"
            " -d --debug               debug mode (keeps child in foreground)\n"
            " -e --exec <str>          specify child executable (default: arg0 of <command>)\n"
            " -f --foreground          keep child in foreground (interactive)\n"
@@ -182,7 +195,20 @@ void printHelp()
            "    --killsig <n>         signal to send to child when killing\n"
            " -l --logport <endpoint>  allow log connections through telnet <endpoint>\n"
            " -L --logfile <file>      write log to <file>, '-' logs to stdout\n"
-           "    --logstamp [<str>]    prefix log lines with timestamp [strftime format]\n"
+           "    --logger-overflow <p> when a logger does not keep up: drop, disconnect\n"
+           "    --logstamp [<str>]    prefix log lines with timestamp [strftime format, %%3N: ms]\n"
+           "    --logsync <policy>    fsync log file: always, none, periodic:<ms>, bytes:<n>\n"
+           "    --log-buffer <n>      buffer up to <n> bytes for the log writer [k|M]\n"
+           "    --log-overflow <p>    when the log writer does not keep up: block, drop\n"
+           "    --log-rotate-size <n> rotate the log file before it exceeds <n> bytes [k|M|G]\n"
+           "    --log-rotate-interval <i> rotate the log file hourly, daily, every <n>m, <n>h\n"
+           "    --log-keep <n>        keep <n> rotated log files [5]\n"
+           "    --log-compress        gzip rotated log files\n"
+           "    --log-gzip [<n>]      write the log file gzip compressed [level 1-9]\n"
+           "    --max-clients <n>     accept at most <n> control connections [64, 0: no limit]\n"
+           "    --max-loggers <n>     accept at most <n> log connections [64, 0: no limit]\n"
+           "    --max-per-source <n>  accept at most <n> connections per address / uid\n"
+           "    --metrics <endpoint>  serve metrics (Prometheus text format) at <endpoint>\n"
            " -n --name <str>          set child's name (default: arg0 of <command>)\n"
            "    --noautorestart       do not restart child on exit by default\n"
            " -o --oneshot             after child exits, exit the server\n"
@@ -190,7 +216,11 @@ void printHelp()
            " -P --port <endpoint>     allow control connections through telnet <endpoint>\n"
            " -q --quiet               suppress informational output (server)\n"
            "    --restrict            restrict log access to connections from localhost\n"
+           "    --scrollback <n>      keep last <n> bytes of output for new clients [k|M]\n"
+           "    --scrollback-lines <n> replay at most <n> lines of scrollback\n"
+           "    --scrollback-to <who> replay scrollback to: all, users, loggers\n"
            "    --timefmt <str>       set time format (strftime) to <str>\n"
+           "    --user-overflow <p>   when a user does not keep up: block, drop, disconnect\n"
            " -V --version             print program version\n"
            " -w --wait                wait for cmd on control connection to start child\n"
            " -x --logoutcmd <str>     command to logout client connection (^ for ctrl)\n"
@@ -205,33 +235,32 @@ void printVersion()
 int main(int argc,char * argv[])
 {
     int c;
-    unsigned int i, j;
+    unsigned int i;
     int k;
     long l;
-    std::vector<std::string> ctlSpecs;
-    char *command;
+    childSettings settings;           // Command line settings of the child(ren)
+    childInstance *in;
     bool bailout = false;
-    const size_t BUFLEN = 512;
-    char buff[BUFLEN];
     std::string infofile;
 
     time(&procServStart);             // remember start time
     procservName = argv[0];
     myDir = getcwd(NULL, 512);
-    chDir = myDir;
+    settings.chDir = myDir;
     timeFormat = defaulttimeFormat;
 
     pidFile = getenv( "PROCSERV_PID" );
     if ( getenv("PROCSERV_DEBUG") != NULL ) inDebugMode = true;
 
-    const int ONE_CHAR_COMMANDS = 3;  // togglerestartcmd, killcmd, logoutcmd
-
     while (1) {
         static struct option long_options[] = {
             {"allow",          no_argument,       0, 'A'},
             {"autorestartcmd", required_argument, 0, 'T'},
+            {"backlog",        required_argument, 0, 'J'},
             {"coresize",       required_argument, 0, 'C'},
             {"chdir",          required_argument, 0, 'c'},
+            {"client-queue",   required_argument, 0, 'Q'},
+            {"config",         required_argument, 0, 'Z'},
             {"debug",          no_argument,       0, 'd'},
             {"exec",           required_argument, 0, 'e'},
             {"foreground",     no_argument,       0, 'f'},
@@ -243,7 +272,20 @@ int main(int argc,char * argv[])
             {"killsig",        required_argument, 0, 'K'},
             {"logport",        required_argument, 0, 'l'},
             {"logfile",        required_argument, 0, 'L'},
+            {"logger-overflow", required_argument, 0, 'X'},
             {"logstamp",       optional_argument, 0, 'S'},
+            {"logsync",        required_argument, 0, 'Y'},
+            {"log-buffer",     required_argument, 0, 'g'},
+            {"log-overflow",   required_argument, 0, 'j'},
+            {"log-rotate-size", required_argument, 0, 'r'},
+            {"log-rotate-interval", required_argument, 0, 't'},
+            {"log-keep",       required_argument, 0, 'v'},
+            {"log-compress",   no_argument,       0, 'z'},
+            {"log-gzip",       optional_argument, 0, 'm'},
+            {"max-clients",    required_argument, 0, 'U'},
+            {"max-loggers",    required_argument, 0, 'O'},
+            {"max-per-source", required_argument, 0, 'E'},
+            {"metrics",        required_argument, 0, 'M'},
             {"name",           required_argument, 0, 'n'},
             {"noautorestart",  no_argument,       0, 'N'},
             {"oneshot",        no_argument,       0, 'o'},
@@ -251,7 +293,11 @@ int main(int argc,char * argv[])
             {"port",           required_argument, 0, 'P'},
             {"quiet",          no_argument,       0, 'q'},
             {"restrict",       no_argument,       0, 'R'},
+            {"scrollback",     required_argument, 0, 'B'},
+            {"scrollback-lines", required_argument, 0, 'G'},
+            {"scrollback-to",  required_argument, 0, 'W'},
             {"timefmt",        required_argument, 0, 'F'},
+            {"user-overflow",  required_argument, 0, 'D'},
             {"version",        no_argument,       0, 'V'},
             {"wait",           no_argument,       0, 'w'},
             {"logoutcmd",      required_argument, 0, 'x'},
@@ -276,16 +322,31 @@ int main(int argc,char * argv[])
                 fprintf( stderr, "%s: --allow not supported\n", procservName );
             break;
 
+        case 'J':                                 // Listen backlog
+            k = atoi( optarg );
+            if ( k > 0 ) {
+                listenBacklog = k;
+            } else {
+                fprintf( stderr, "%s: invalid backlog '%s'\n",
+                         procservName, optarg );
+                bailout = true;
+            }
+            break;
+
         case 'C':                                 // Core size
             l = atol( optarg );
             if ( l >= 0 ) {
-                coreSize = l;
-                setCoreSize = true;
+                settings.coreSize = l;
+                settings.setCoreSize = true;
             }
             break;
 
         case 'c':                                 // Dir to change to
-            chDir = strdup( optarg );
+            settings.chDir = strdup( optarg );
+            break;
+
+        case 'Z':                                 // Config file (supervisor mode)
+            configFile = strdup( optarg );
             break;
 
         case 'd':                                 // Debug mode
@@ -293,7 +354,7 @@ int main(int argc,char * argv[])
             break;
 
         case 'e':                                 // Child executable
-            childExec = strdup( optarg );
+            settings.childExec = strdup( optarg );
             break;
 
         case 'f':                                 // Foreground mode
@@ -310,29 +371,114 @@ int main(int argc,char * argv[])
                 stampFormat = strdup(optarg);
             break;
 
+        case 'Y':                                 // Log file sync policy
+            if ( !parseLogSync( optarg ) ) {
+                fprintf( stderr, "%s: invalid log sync policy '%s'\n",
+                         procservName, optarg );
+                bailout = true;
+            }
+            break;
+
+        case 'g':                                 // Log writer buffer size
+            if ( !parseLogBufferSize( optarg ) ) {
+                fprintf( stderr, "%s: invalid log buffer size '%s'\n",
+                         procservName, optarg );
+                bailout = true;
+            }
+            break;
+
+        case 'j':                                 // Log writer overflow policy
+            if ( !parseLogOverflow( optarg ) ) {
+                fprintf( stderr, "%s: invalid log overflow policy '%s'\n",
+                         procservName, optarg );
+                bailout = true;
+            }
+            break;
+
+        case 'r':                                 // Log rotation size
+            if ( !parseLogRotateSize( optarg ) ) {
+                fprintf( stderr, "%s: invalid log rotation size '%s'\n",
+                         procservName, optarg );
+                bailout = true;
+            }
+            break;
+
+        case 't':                                 // Log rotation interval
+            if ( !parseLogRotateInterval( optarg ) ) {
+                fprintf( stderr, "%s: invalid log rotation interval '%s'\n",
+                         procservName, optarg );
+                bailout = true;
+            }
+            break;
+
+        case 'v':                                 // Rotated log files to keep
+            l = atol( optarg );
+            if ( l >= 1 && l <= 999 ) logKeep = l;
+            else {
+                fprintf( stderr, "%s: invalid number of log files to keep '%s'\n",
+                         procservName, optarg );
+                bailout = true;
+            }
+            break;
+
+        case 'z':                                 // Compress rotated log files
+#ifdef HAVE_ZLIB
+            logCompress = true;
+#else
+            fprintf( stderr, "%s: --log-compress is not supported (built without zlib)\n",
+                     procservName );
+            bailout = true;
+#endif
+            break;
+
+        case 'm':                                 // Compressed log file
+#ifdef HAVE_ZLIB
+            l = optarg ? atol( optarg ) : 6;
+            if ( l >= 1 && l <= 9 ) logGzipLevel = l;
+            else {
+                fprintf( stderr, "%s: invalid compression level '%s'\n",
+                         procservName, optarg );
+                bailout = true;
+            }
+#else
+            fprintf( stderr, "%s: --log-gzip is not supported (built without zlib)\n",
+                     procservName );
+            bailout = true;
+#endif
+            break;
+
+        case 'B':                                 // Scrollback size
+            if ( !parseScrollbackSize( optarg ) ) {
+                fprintf( stderr, "%s: invalid scrollback size '%s'\n",
+                         procservName, optarg );
+                bailout = true;
+            }
+            break;
+
+        case 'G':                                 // Scrollback lines
+            l = atol( optarg );
+            if ( l >= 0 ) scrollbackLines = l;
+            break;
+
+        case 'W':                                 // Scrollback receivers
+            if ( !parseScrollbackTo( optarg ) ) {
+                fprintf( stderr, "%s: invalid scrollback receivers '%s'\n",
+                         procservName, optarg );
+                bailout = true;
+            }
+            break;
+
         case 'h':                                 // Help
             printHelp();
             exit(0);
 
         case 'H':                                 // Holdoff time
             k = atoi( optarg );
-            if ( k >= 0 ) holdoffTime = k;
+            if ( k >= 0 ) settings.holdoffTime = k;
             break;
 
         case 'i':                                 // Ignore characters
-            ignChars = (char*) calloc( strlen(optarg) + 1 + ONE_CHAR_COMMANDS, 1);
-            i = j = 0;          // ^ escapes (CTRL)
-            while ( i <= strlen(optarg) ) {
-                if ( optarg[i] == '^' && optarg[i+1] == '^' ) {
-                    ignChars[j++] = '^';
-                    i += 2 ;
-                } else if ( optarg[i] == '^' && optarg[i+1] >= 'A' && optarg[i+1] <= 'Z' ) {
-                    ignChars[j++] = optarg[i+1] - 64;
-                    i += 2;
-                } else {
-                    ignChars[j++] = optarg[i++];
-                }
-            }
+            settings.ignChars = getIgnoreChars( optarg );
             break;
 
         case 'I':                                 // Info file
@@ -340,38 +486,76 @@ int main(int argc,char * argv[])
             break;
 
         case 'k':                                 // Kill command
-            killChar = getOptionChar ( optarg );
+            settings.killChar = getOptionChar ( optarg );
             break;
 
         case 'K':                                 // Kill signal
             i = abs( atoi( optarg ) );
             if ( i < 32 ) {
-                killSig = i;
+                settings.killSig = i;
             } else {
                 fprintf( stderr,
                          "%s: invalid kill signal %d (>31) - using default (%d)\n",
-                         procservName, i, killSig );
+                         procservName, i, settings.killSig );
             }
             break;
 
         case 'l':                                 // Log port
-            logPort = strdup ( optarg );
+            settings.logPort = strdup ( optarg );
             break;
 
         case 'L':                                 // Log file
-            logFile = strdup( optarg );
+            settings.logFile = strdup( optarg );
+            break;
+
+        case 'U':                                 // Max. control connections
+        case 'O':                                 // Max. log connections
+        case 'E':                                 // Max. connections per source
+            k = atoi( optarg );
+            if ( k < 0 ) {
+                fprintf( stderr, "%s: invalid connection limit '%s'\n",
+                         procservName, optarg );
+                bailout = true;
+            } else if ( c == 'U' ) {
+                maxClients = k;
+            } else if ( c == 'O' ) {
+                maxLoggers = k;
+            } else {
+                maxPerSource = k;
+            }
+            break;
+
+        case 'Q':                                 // Client output queue size
+            if ( !parseClientQueueSize( optarg ) ) {
+                fprintf( stderr, "%s: invalid client queue size '%s'\n",
+                         procservName, optarg );
+                bailout = true;
+            }
+            break;
+
+        case 'D':                                 // Overflow policy (users)
+        case 'X':                                 // Overflow policy (loggers)
+            if ( !parseOverflowPolicy( optarg, c == 'X' ) ) {
+                fprintf( stderr, "%s: invalid %s overflow policy '%s'\n",
+                         procservName, c == 'X' ? "logger" : "user", optarg );
+                bailout = true;
+            }
+            break;
+
+        case 'M':                                 // Metrics endpoint
+            metricsPort = strdup ( optarg );
             break;
 
         case 'n':                                 // Name
-            childName = strdup( optarg );
+            settings.childName = strdup( optarg );
             break;
 
         case 'N':                                 // No restart of child
-            restartMode = norestart;
+            settings.restartMode = norestart;
             break;
 
         case 'o':                                 // Exit server when child exits
-            restartMode = oneshot;
+            settings.restartMode = oneshot;
             break;
 
         case 'R':                                 // Restrict log
@@ -383,7 +567,7 @@ int main(int argc,char * argv[])
             break;
 
         case 'P':                                 // Control port
-            ctlSpecs.push_back(optarg);
+            settings.ctlSpecs.push_back(optarg);
             singleEndpointStyle = false;
             break;
 
@@ -396,15 +580,15 @@ int main(int argc,char * argv[])
             exit(0);
 
         case 'w':                                 // Wait for manual start
-            waitForManualStart = true;
+            settings.waitForManualStart = true;
             break;
 
         case 'x':                                 // Logout command
-            logoutChar = getOptionChar(optarg);
+            settings.logoutChar = getOptionChar(optarg);
             break;
 
         case 'T':                                 // Toggle auto restart command
-            toggleRestartChar = getOptionChar ( optarg );
+            settings.toggleRestartChar = getOptionChar ( optarg );
             break;
 
         case '?':                                 // Error
@@ -417,7 +601,15 @@ int main(int argc,char * argv[])
         }
     }
 
-    if ((argc - optind) < (singleEndpointStyle ? 2 : 1)) {
+    if (configFile) {
+        // Supervisor mode: these are set per child in the config file
+        if (argc > optind || !settings.ctlSpecs.empty() || settings.logPort
+                || settings.logFile || settings.childName || settings.childExec) {
+            fprintf(stderr, "%s: endpoints, log file, name and command of the children"
+                    " belong into the config file\n", procservName);
+            bailout = true;
+        }
+    } else if ((argc - optind) < (singleEndpointStyle ? 2 : 1)) {
         fprintf(stderr, "%s: missing argument\n", procservName);
         bailout = true;
     }
@@ -427,38 +619,23 @@ int main(int argc,char * argv[])
         exit(1);
     }
 
-    // Single command characters should be ignored, too
-    if (ignChars == NULL && (killChar || toggleRestartChar || logoutChar))
-        ignChars = (char*) calloc(1 + ONE_CHAR_COMMANDS, 1);
-    if (killChar)
-        strncat (ignChars, &killChar, 1);
-    if (toggleRestartChar)
-        strncat (ignChars, &toggleRestartChar, 1);
-    if (logoutChar)
-        strncat (ignChars, &logoutChar, 1);
-
-    // Set up available server commands message
+    // Set up the child instance(s)
     PRINTF("Setting up messages\n");
-    snprintf(infoMessage3, INFO3LEN,\
-            "@@@ %s%c or %s%c restarts the child, %s%c quits the server",
-            CTL_SC(restartChar), CTL_SC(killChar), CTL_SC(quitChar));
-    if (logoutChar) {
-        snprintf(buff, BUFLEN, ", %s%c closes this connection",
-                CTL_SC(logoutChar));
-        strncat(infoMessage3, buff, INFO3LEN-strlen(infoMessage3)-1);
-    }
-    strncat(infoMessage3, NL, INFO3LEN-strlen(infoMessage3)-1);
-
-    if (singleEndpointStyle) {
-        ctlSpecs.push_back(argv[optind++]);
-    }
-    command = argv[optind];
+    if (configFile) {
+        if (!readConfigFile(configFile, settings)) exit(1);
+    } else {
+        if (singleEndpointStyle) {
+            settings.ctlSpecs.push_back(argv[optind++]);
+        }
+        settings.command = argv[optind];
 
-    if (childName == NULL) childName = command;
-    childArgv = argv + optind - 1;
-    if (childExec == NULL) {
-        childArgv++;
-        childExec = command;
+        if (settings.childName == NULL) settings.childName = settings.command;
+        settings.childArgv = argv + optind - 1;
+        if (settings.childExec == NULL) {
+            settings.childArgv++;
+            settings.childExec = settings.command;
+        }
+        new childInstance(settings);
     }
 
     if (!stampFormat) {
@@ -491,6 +668,9 @@ int main(int argc,char * argv[])
     sigaddset(&sigset_block, SIGPIPE);
     sigaddset(&sigset_block, SIGTERM);
     sigaddset(&sigset_block, SIGHUP);
+    // The child's exit is noticed through its pidfd where possible;
+    // SIGCHLD is always handled, in case there is no pidfd for a child
+    sigaddset(&sigset_block, SIGCHLD);
     sigprocmask(SIG_BLOCK, &sigset_block, &sigset_pselect);
     
     sig.sa_handler = &OnSigPipe;              // sigaction() needed for Solaris
@@ -499,6 +679,8 @@ int main(int argc,char * argv[])
     sigaction(SIGTERM, &sig, NULL);
     sig.sa_handler = &OnSigHup;
     sigaction(SIGHUP, &sig, NULL);
+    sig.sa_handler = &OnSigChld;
+    sigaction(SIGCHLD, &sig, NULL);
     sig.sa_handler = SIG_IGN;
     sigaction(SIGXFSZ, &sig, NULL);
     if (inFgMode) {
@@ -508,34 +690,59 @@ int main(int argc,char * argv[])
         sigaction(SIGQUIT, &sig, NULL);
     }
 
-    // Make an accept item to listen for control connections
-    PRINTF("Creating control listener\n");
-    try
-    {
-        for(size_t i=0; i<ctlSpecs.size(); i++) {
-            connectionItem *acceptItem = acceptFactory( ctlSpecs[i].c_str(), ctlPortLocal );
-            AddConnection(acceptItem);
+    evLoop = eventLoopFactory();
+    PRINTF("Using %s event loop\n", evLoop->name());
+
+    for (in = childInstance::head; in; in = in->next) {
+        // Make an accept item to listen for control connections
+        PRINTF("Creating control listener\n");
+        try
+        {
+            for(size_t i=0; i<in->ctlSpecs.size(); i++) {
+                connectionItem *acceptItem = acceptFactory( in->ctlSpecs[i].c_str(), ctlPortLocal,
+                                                            false, clientFactory, in );
+                AddConnection(acceptItem);
+            }
+        }
+        catch (int error)
+        {
+            perror("Caught an exception creating the initial control telnet port");
+            fprintf(stderr, "%s: Exiting with error code: %d\n",
+                    procservName, error);
+            exit(error);
+        }
+
+        if ( in->logPort ) {
+            // Make an accept item to listen for log connections
+            PRINTF("Creating log listener\n");
+            try
+            {
+                connectionItem *acceptItem = acceptFactory( in->logPort, logPortLocal, true,
+                                                            clientFactory, in );
+                AddConnection(acceptItem);
+            }
+            catch (int error)
+            {
+                perror("Caught an exception creating the initial log telnet port");
+                fprintf(stderr, "%s: Exiting with error code: %d\n",
+                        procservName, error);
+                exit(error);
+            }
         }
-    }
-    catch (int error)
-    {
-        perror("Caught an exception creating the initial control telnet port");
-        fprintf(stderr, "%s: Exiting with error code: %d\n",
-                procservName, error);
-        exit(error);
     }
 
-    if ( logPort ) {
-        // Make an accept item to listen for log connections
-        PRINTF("Creating log listener\n");
+    if ( metricsPort ) {
+        // Make an accept item to listen for metrics readers
+        PRINTF("Creating metrics listener\n");
         try
         {
-            connectionItem *acceptItem = acceptFactory( logPort, logPortLocal, true );
+            connectionItem *acceptItem = acceptFactory( metricsPort, ctlPortLocal, true,
+                                                        metricsFactory );
             AddConnection(acceptItem);
         }
         catch (int error)
         {
-            perror("Caught an exception creating the initial log telnet port");
+            perror("Caught an exception creating the metrics port");
             fprintf(stderr, "%s: Exiting with error code: %d\n",
                     procservName, error);
             exit(error);
@@ -544,7 +751,7 @@ int main(int argc,char * argv[])
 
     procservPid=getpid();
 
-    openLogFile();
+    for (in = childInstance::head; in; in = in->next) openLogFile(in);
 
     if (false == inFgMode && false == inDebugMode)
     {
@@ -557,139 +764,120 @@ int main(int argc,char * argv[])
         writePidFile(procservPid);
     }
 
-    setEnvVar();
+    for (in = childInstance::head; in; in = in->next) setEnvVar(in);
 
     if (!infofile.empty()) {
         writeInfoFile(infofile);
     }
 
-    if (inFgMode && !(logFile && strcmp(logFile, "-")==0)) {
+    // The console is connected to the first child
+    in = childInstance::head;
+    if (inFgMode && !(in->logFile && strcmp(in->logFile, "-")==0)) {
         ttySetCharNoEcho(true);
-        AddConnection(clientFactory(0));
+        AddConnection(clientFactory(0, false, in));
     }
 
-    // Record some useful data for managers 
-    snprintf(infoMessage1, INFO1LEN,
-             "@@@ procServ server PID: %ld" NL
-             "@@@ Server startup directory: %s" NL
-             "@@@ Child startup directory: %s" NL,
-             (long) getpid(),
-             myDir,
-             chDir);
-    if ( strcmp( childName, command ) )
-        snprintf(buff, BUFLEN, "@@@ Child \"%s\" started as: %s" NL,
-                 childName, command );
-    else
-        snprintf(buff, BUFLEN, "@@@ Child started as: %s" NL,
-                 command );
-    strncat(infoMessage1, buff, INFO1LEN-strlen(infoMessage1)-1);
-    snprintf(infoMessage2, INFO2LEN, "@@@ Child \"%s\" is SHUT DOWN" NL, childName);
-    if ( logFile ) {
-	if ( -1 == logFileFD )
-            snprintf(buff, BUFLEN, "@@@ Child log file: unable to open log file %s" NL,
-                     logFile );
-	else
-            snprintf(buff, BUFLEN, "@@@ Child log file: %s" NL,
-                     logFile );
-        strncat(infoMessage1, buff, INFO1LEN-strlen(infoMessage1)-1);
-    }
+    for (in = childInstance::head; in; in = in->next) setupMessages(in);
 
-    firstRun = true;
     // Run here until something makes it die
     while ( ! shutdownServer )
     {
         const size_t BUFLEN = 100;
         char buf[BUFLEN];
-        connectionItem * p;
-        fd_set fdset;              // FD stuff for select()
-        int fd, nFd;
-        int ready;                 // select() return value
+        int ready;                 // event loop wait() return value
         struct timespec timeout;
 
-        // Prepare FD set for select()
-        p = connectionItem::head;
-        nFd = -1;
-        FD_ZERO(&fdset);
-        while (p) {
-            if ((fd = p->getFd()) > -1) {     // Connection needs to be watched
-                if (fd > nFd) nFd = fd;
-                FD_SET(fd, &fdset);
-            }
-            p = p->next;
+        // Sleep until something happens or the next timer is due
+        // (forever if no timer is armed), but not if the child is due
+        // to be started
+        if (processFactoryNeedsRestart()) {
+            timeout.tv_sec = 0;
+            timeout.tv_nsec = 0;
+            ready = evLoop->wait(&timeout, &sigset_pselect);
+        } else {
+            ready = evLoop->wait(eventTimer::nextTimeout(&timeout) ? &timeout : NULL,
+                                 &sigset_pselect);
         }
-        nFd++;
-        timeout.tv_sec = 0;                   // select() timeout: 0.5 sec
-        timeout.tv_nsec = 500000000l;
 
-        ready = pselect(nFd, &fdset, NULL, NULL, &timeout, &sigset_pselect);
-        
         // Handle signals for which signal handlers were called while in pselect.
         
         if (sigPipeSet) {
             sigPipeSet = 0;
             sprintf( buf, "@@@ Got a sigPipe signal: Did the child close its tty?" NL);
-            SendToAll( buf, strlen(buf), NULL );
+            for (in = childInstance::head; in; in = in->next)
+                SendToAll( buf, strlen(buf), NULL, in );
         }
         
         if (sigTermSet) {
             sigTermSet = 0;
             PRINTF("SigTerm received\n");
-            processFactorySendSignal(killSig);
+            for (in = childInstance::head; in; in = in->next)
+                processFactorySendSignal(in, in->killSig);
             shutdownServer = true;
         }
 
         if (sigHupSet) {
             sigHupSet = 0;
             PRINTF("SigHup received\n");
-            openLogFile();
+            for (in = childInstance::head; in; in = in->next) openLogFile(in);
         }
-        
-        if (0 == ready) {                     // Timeout
-            // Go clean up dead connections
-            OnPollTimeout();
-            connectionItem * npi; 
-
-            // Pick up the process item if it dies
-            // This call returns NULL if the process item lives
-            if (processFactoryNeedsRestart())
-            {
-                if ((restartMode == oneshot) && !firstRun) {
+
+        if (sigChldSet) {
+            sigChldSet = 0;
+            PRINTF("SigChld received\n");
+            reapChildren();
+        }
+
+        if (-1 == ready) {                    // Error
+            if (EINTR != errno) {
+                perror("Error in event loop wait() call");
+            }
+        } else if (ready > 0) {               // Work to be done
+            // Only the ready connections are dispatched
+            evLoop->dispatch();
+        }
+
+        eventTimer::runExpired();
+
+        // Go clean up dead connections
+        OnPollTimeout();
+
+        // Pick up the process item if it died
+        // (right away, not only when the loop is idle)
+        if (processFactoryNeedsRestart())
+        {
+            for (in = childInstance::head; in; in = in->next) {
+              connectionItem * npi;
+
+              if (!processFactoryNeedsRestart(in)) continue;
+              if ((in->restartMode == oneshot) && !in->firstRun) {
+                PRINTF("Oneshot child \"%s\" is done\n", in->childName);
+                in->finished = true;
+                if (allFinished()) {
                   PRINTF("Option oneshot is set... exiting\n");
                   shutdownServer = true;
-                } else {
-		  if (logFileFD > 0) {
-		    fcntl(logFileFD, F_SETFD, FD_CLOEXEC);
-		  }
-                  npi= processFactory(childExec, childArgv);
-                  if (npi) AddConnection(npi);
-                  if (firstRun) {
-                  	firstRun = false;
-                  }
                 }
+              } else {
+                npi= processFactory(in);
+                if (npi) AddConnection(npi);
+                if (in->firstRun) {
+                  in->firstRun = false;
+                }
+              }
             }
-        } else if (-1 == ready) {             // Error
-            if (EINTR != errno) {
-                perror("Error in select() call");
-            }
-        } else {                              // Work to be done
-            // Loop through all connections
-            p = connectionItem::head;
-            while (p) {
-                if (FD_ISSET(p->getFd(), &fdset)) p->readFromFd();
-                p = p->next;
-            }
-            OnPollTimeout();
         }
+
+        // Write out what was logged during this iteration
+        logFlush();
     }
     ttySetCharNoEcho(false);
 
     PRINTF("Close sockets\n");
 
     while(connectionItem::head) {
-        connectionItem *p = connectionItem::head;
-        connectionItem::head = p->next;
-        delete p;
+        DeleteConnection(connectionItem::head);
     }
+    logFlush(true);
 
     PRINTF("Cleanup pid and info files\n");
 
@@ -708,86 +896,80 @@ int main(int argc,char * argv[])
 // //
 void SendToAll(const char * message,
                int count,
-               const connectionItem * sender)
+               const connectionItem * sender,
+               childInstance * instance)
 {
-    connectionItem * p = connectionItem::head;
-    char stamp[64];
+    if (!instance) instance = sender->instance;
+    connectionItem * p = instance->members;
+    const char *stamp = NULL;
     int len = 0;
-    time_t now;
-    struct tm now_tm;
 
-    time(&now);
-    localtime_r(&now, &now_tm);
-    strftime(stamp, sizeof(stamp)-1, stampFormat, &now_tm);
-    len = strlen(stamp);
+    // Only output to the log and the clients gets time stamps
+    if (stampLog && (sender==NULL || sender->isProcess()))
+        stamp = logStamp(&len);
 
-    // Log the traffic to file / stdout (debug)
+    // Log the traffic to file / stdout (debug), keep it for the scrollback
     if (sender==NULL || sender->isProcess())
     {
-        if (logFileFD > 0) {
+        if (instance->logFileFD > 0) {
             if (stampLog) {
                 // Some OSs (Windows) do not support line buffering, so we can get parts of lines,
                 // hence need to track of when to send timestamp
-                static bool log_stamp_sent = false;
-                int i = 0, j = 0;
-                for (i = 0; i < count; ++i) {
-                    if (!log_stamp_sent) {
-                        ignore_result( write(logFileFD, stamp, len) );
-                        log_stamp_sent = true;
-                    }
-                    if (message[i] == '\n') {
-                        ignore_result( write(logFileFD, message+j, i-j+1) );
-                        j = i + 1;
-                        log_stamp_sent = false;
-                    }
-                }
-                ignore_result( write(logFileFD, message+j, count-j) );  // finish off rest of line with no newline at end
+                static std::vector<struct iovec> iov;
+                stampLines(message, count, stamp, len, instance->logLineStart, iov);
+                if (!iov.empty()) logWritev(instance, &iov[0], iov.size());
             } else {
-                ignore_result( write(logFileFD, message, count) );
+                logWrite(instance, message, count);
             }
-            fsync(logFileFD);
         }
+        scrollbackAppend(instance, message, count);
         if (inFgMode == false && debugFD > 0) ignore_result( write(debugFD, message, count) );
     }
 
+    // Encoded once, shared by all clients
+    sharedOutput out(message, count, stamp, len);
+
     while (p) {
         if (p->isProcess()) {
             // Non-null senders that are not processes can send to processes
             if (sender && !sender->isProcess()) p->Send(message, count);
         } else {
             // Null senders and processes can send to connections, with time stamp
-            if (!sender || sender->isProcess()) {
-                if (stampLog)
-                    p->Send(stamp, len, message, count);
-                else
-                    p->Send(message, count);
-            }
+            if (!sender || sender->isProcess()) p->Send(out);
         }
-        p = p->next;
+        p = p->memberNext;
     }
 }
 
 
-// Handles housekeeping
-void OnPollTimeout()
+// Collects exited children
+// Called when the pidfd of the child becomes readable or SIGCHLD was received
+void reapChildren()
 {
     pid_t pid;
     int wstatus;
-    connectionItem *pc, *pn;
+    connectionItem *pc;
+    childInstance *in;
     const size_t BUFLEN = 128;
-    char buf[BUFLEN] = NL;
+    char buf[BUFLEN];
+
+    while ((pid = waitpid(-1, &wstatus, WNOHANG)) > 0) {
+        // Whose child was it?
+        for (in = childInstance::head; in && in->childPid != pid; in = in->next);
+        if (!in) continue;
+        in->childPid = 0;
+        processFactoryRecheck();
 
-    pid = waitpid(-1, &wstatus, WNOHANG);
-    if (pid > 0 ) {
-        pc = connectionItem::head;
+        strcpy(buf, NL);
+        pc = in->members;
         while (pc) {
             pc->markDeadIfChildIs(pid);
-            pc=pc->next;
+            pc=pc->memberNext;
         }
 
-        SendToAll(buf, strlen(buf), NULL);
+        SendToAll(buf, strlen(buf), NULL, in);
         strcpy(buf, "@@@ @@@ @@@ @@@ @@@" NL);
-        SendToAll(buf, strlen(buf), NULL);
+        SendToAll(buf, strlen(buf), NULL, in);
 
         snprintf(buf, BUFLEN, "@@@ Received a sigChild for process %ld.", (long) pid);
 
@@ -796,18 +978,40 @@ void OnPollTimeout()
                      " Normal exit status = %d",
                      WEXITSTATUS(wstatus));
             childExitCode = WEXITSTATUS(wstatus);
+            metrics.childExits++;
+            in->counters.exits++;
+            metrics.childLastExitCode = childExitCode;
         }
 
         if (WIFSIGNALED(wstatus)) {
             snprintf(buf+strlen(buf), BUFLEN-strlen(buf),
                      " The process was killed by signal %d",
                      WTERMSIG(wstatus));
+            metrics.childKills++;
+            in->counters.kills++;
+            metrics.childLastSignal = WTERMSIG(wstatus);
         }
         strncat(buf, NL, BUFLEN-strlen(buf)-1);
-        SendToAll(buf, strlen(buf), NULL);
+        SendToAll(buf, strlen(buf), NULL, in);
     }
+}
+
+// True when all children are done (oneshot mode)
+static bool allFinished()
+{
+    for (childInstance *in = childInstance::head; in; in = in->next)
+        if (!in->finished) return false;
+    return true;
+}
+
+// Handles housekeeping
+void OnPollTimeout()
+{
+    connectionItem *pc, *pn;
 
     // Clean up connections
+    if (!connectionItem::deadPending) return;
+    connectionItem::deadPending = false;
     pc = connectionItem::head;
     while (pc)
     {
@@ -831,6 +1035,20 @@ void AddConnection(connectionItem * ci)
 	ci->prev=NULL;
 	connectionItem::head=ci;
 	connectionNo++;
+	if (ci->instance) {     // Join the party line of its instance
+	    childInstance *in = ci->instance;
+	    ci->memberNext = in->members;
+	    if (in->members) in->members->memberPrev = ci;
+	    ci->memberPrev = NULL;
+	    in->members = ci;
+	}
+	evLoop->add(ci);
+}
+
+// Call this after the fd of a listed connection has changed
+void UpdateConnection(connectionItem *ci)
+{
+    evLoop->update(ci);
 }
 
 
@@ -846,6 +1064,12 @@ void DeleteConnection(connectionItem *ci)
 		connectionItem::head = ci->next;
 	}
 	if (ci->next) ci->next->prev=ci->prev;
+	if (ci->instance) {
+	    if (ci->memberPrev) ci->memberPrev->memberNext = ci->memberNext;
+	    else ci->instance->members = ci->memberNext;
+	    if (ci->memberNext) ci->memberNext->memberPrev = ci->memberPrev;
+	}
+	evLoop->remove(ci);
         delete ci;
 	connectionNo--;
 	assert(connectionNo>=0);
@@ -866,6 +1090,11 @@ static void OnSigHup(int)
     sigHupSet = 1;
 }
 
+static void OnSigChld(int)
+{
+    sigChldSet = 1;
+}
+
 // Fork the daemon and exit the parent
 void forkAndGo()
 {
@@ -888,9 +1117,15 @@ void forkAndGo()
         close(fh);
         if (!quiet) {
             fprintf(stderr, "%s: spawning daemon process: %ld\n", procservName, (long) p);
-            if (-1 == logFileFD) {
-                fprintf(stderr, "Warning: No log file%s specified.\n",
-                        logPort ? "" : " and no port for log connections");
+            for (childInstance *in = childInstance::head; in; in = in->next) {
+                if (-1 != in->logFileFD) continue;
+                if (childInstance::count == 1)
+                    fprintf(stderr, "Warning: No log file%s specified.\n",
+                            in->logPort ? "" : " and no port for log connections");
+                else
+                    fprintf(stderr, "Warning: No log file%s specified for child \"%s\".\n",
+                            in->logPort ? "" : " and no port for log connections",
+                            in->childName);
             }
         }
         // Write the pid file _on behalf of the child_ before exiting.
@@ -912,44 +1147,60 @@ void forkAndGo()
 }
 
 
-void openLogFile()
-{
-    if (-1 != logFileFD && 1 != logFileFD) {
-        close(logFileFD);
-    }
-    if (logFile && strcmp(logFile, "-")==0) {
-        logFileFD = 1;
-    } else
-    if (logFile) {
-        logFileFD = open(logFile, O_CREAT|O_WRONLY|O_APPEND, S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH);
-        if (-1 == logFileFD) {         // Don't stop here - just go without
-            fprintf(stderr,
-                    "%s: unable to open log file %s\n",
-                    procservName, logFile);
-        } else {
-            PRINTF("Opened file %s for logging\n", logFile);
-        }
-    }
-}
-
+// In supervisor mode, the endpoints of each child follow a "child:<name>" line
 void writeInfoFile(const std::string& infofile)
 {
     std::ofstream info(infofile.c_str());
     info<<"pid:"<<getpid()<<"\n";
-    for(connectionItem *it = connectionItem::head; it; it=it->next)
-        it->writeAddress(info);
+    for(childInstance *in = childInstance::head; in; in = in->next) {
+        if (configFile) info<<"child:"<<in->childName<<"\n";
+        for(connectionItem *it = in->members; it; it=it->memberNext)
+            it->writeAddress(info);
+    }
 }
 
-void setEnvVar()
+// PROCSERV_INFO for the child of an instance (set when it is started)
+void setEnvVar(childInstance *in)
 {
     std::ostringstream env_var;
     env_var<<"PID="<<getpid()<<";";
-    for(connectionItem *it = connectionItem::head; it; it=it->next)
+    for(connectionItem *it = in->members; it; it=it->memberNext)
         it->writeAddressEnv(env_var);
     std::string env_str = env_var.str();
     // Remove the extra semicolon
-    env_str = env_str.substr(0, env_str.size()-1);
-    setenv("PROCSERV_INFO", env_str.c_str(), 1);
+    in->envInfo = env_str.substr(0, env_str.size()-1);
+}
+
+// Record some useful data for managers
+void setupMessages(childInstance *in)
+{
+    char *msg = in->infoMessage1;
+    size_t len;
+
+    len = snprintf(msg, INFO1LEN,
+                   "@@@ procServ server PID: %ld" NL
+                   "@@@ Server startup directory: %s" NL
+                   "@@@ Child startup directory: %s" NL,
+                   (long) getpid(),
+                   myDir,
+                   in->chDir);
+    if ( len < INFO1LEN ) {
+        if ( strcmp( in->childName, in->command ) )
+            len += snprintf(msg + len, INFO1LEN - len, "@@@ Child \"%s\" started as: %s" NL,
+                            in->childName, in->command );
+        else
+            len += snprintf(msg + len, INFO1LEN - len, "@@@ Child started as: %s" NL,
+                            in->command );
+    }
+    snprintf(in->infoMessage2, INFO2LEN, "@@@ Child \"%s\" is SHUT DOWN" NL, in->childName);
+    if ( in->logFile && len < INFO1LEN ) {
+	if ( -1 == in->logFileFD )
+            snprintf(msg + len, INFO1LEN - len, "@@@ Child log file: unable to open log file %s" NL,
+                     in->logFile );
+	else
+            snprintf(msg + len, INFO1LEN - len, "@@@ Child log file: %s" NL,
+                     in->logFile );
+    }
 }
 
 void ttySetCharNoEcho(bool set) {
@@ -974,6 +1225,6 @@ void ttySetCharNoEcho(bool set) {
 }
 
 connectionItem * connectionItem::head;
+bool connectionItem::deadPending;
 // Globals:
 time_t procServStart; // Time when this IOC started
-time_t IOCStart; // Time when the current IOC was started
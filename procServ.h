@@ -9,6 +9,7 @@
 #define procServH
 
 #include <ostream>
+#include <string>
 
 #include <sys/types.h>
 #include <sys/socket.h>
@@ -33,72 +34,141 @@
 #define PROCSERV_VERSION_STRING PACKAGE_STRING
 
 enum RestartMode { restart, norestart, oneshot };
+enum LogSyncMode { logSyncAlways, logSyncNone, logSyncPeriodic, logSyncBytes };
+enum LogOverflow { logOverflowBlock, logOverflowDrop };
+enum ScrollbackTo { scrollbackAll, scrollbackUsers, scrollbackLoggers };
+enum OverflowPolicy { overflowDisconnect, overflowDrop, overflowBlock };
 
 extern bool   inDebugMode;
 extern bool   logPortLocal;
-extern bool   waitForManualStart;
 extern volatile bool shutdownServer;
-extern bool   setCoreSize;
-extern RestartMode restartMode;
-extern bool   firstRun;
 extern char   *procservName;
-extern char   *childName;
-extern char   *ignChars;
+extern char   *configFile;
 extern const char   *timeFormat;
-extern char   killChar;
-extern char   toggleRestartChar;
-extern char   restartChar;
-extern char   quitChar;
-extern char   logoutChar;
-extern int    killSig;
-extern const size_t INFO1LEN;
-extern const size_t INFO2LEN;
-extern const size_t INFO3LEN;
-extern char   infoMessage1[];
-extern char   infoMessage2[];
-extern char   infoMessage3[];
+extern const char   *stampFormat;
+extern int    listenBacklog;
+extern int    maxClients;
+extern int    maxLoggers;
+extern int    maxPerSource;
+const size_t INFO1LEN = 512;
+const size_t INFO2LEN = 128;
+const size_t INFO3LEN = 128;
 extern pid_t  procservPid;
-extern rlim_t coreSize;
-extern char   *chDir;
-extern time_t holdoffTime;
+extern LogSyncMode logSyncMode;
+extern long   logSyncArg;
+extern size_t logBufferSize;
+extern LogOverflow logOverflow;
+extern int    logGzipLevel;
+extern size_t scrollbackSize;
+extern long   scrollbackLines;
+extern ScrollbackTo scrollbackTo;
 
 #define NL "\r\n"
 
 #define CTL_SC(c) c > 0 && c < 32 ? "^" : "", c > 0 && c < 32 ? c + 64 : c
 
 class connectionItem;
+class childInstance;
+class sharedOutput;
+struct iovec;
+class outputChunk;
+struct clientMetrics;
+
+// Log rotation (see logRotate.cc), done by the log writer thread
+extern size_t logRotateSize;
+extern long   logRotateInterval;
+extern int    logKeep;
+extern bool   logCompress;
+bool parseLogRotateSize(const char *arg);
+bool parseLogRotateInterval(const char *arg);
+time_t logRotateNext(time_t now);
+bool logRotateDue(childInstance *in, size_t len);
+void logRotate(childInstance *in);
 
 extern time_t procServStart; // Time when this IOC started
-extern time_t IOCStart;      // Time when the current IOC was started
 
 // Connection items call this to send messages to others
 // This is a party line system, messages go to everyone
 // the sender's this pointer keeps it from getting its own
 // messages.
+// Only the party line of one child instance is reached: the sender's,
+// unless an instance is given (required if there is no sender).
 void SendToAll(const char * message,
                int count,
-               const connectionItem * sender);
+               const connectionItem * sender,
+               childInstance * instance = NULL);
+
+// Parse the argument of a command character option (^ for ctrl)
+char getOptionChar(const char *buf);
+// Parse the argument of --ignore (^ for ctrl) into a malloc'ed string
+// (the ignored command characters are added by childInstance)
+char * getIgnoreChars(const char *buf);
+
+// Log file: writes are buffered and handed to a writer thread, which
+// writes them out (and fsyncs according to the --logsync policy);
+// the main loop calls logFlush() once per iteration
+void openLogFile(childInstance *instance);
+void logWrite(childInstance *instance, const char *buf, size_t len);
+void logWritev(childInstance *instance, const struct iovec *iov, int n);
+void logFlush(bool force = false);
+size_t logQueuedBytes();      // Bytes waiting for the writer thread
+bool parseLogSync(const char *arg);
+bool parseLogBufferSize(const char *arg);
+bool parseLogOverflow(const char *arg);
+
+// Log time stamp (--logstamp), cached: formatted once per second
+const char * logStamp(int *len);
+
+// Scrollback: recent party line output, replayed to new clients
+void scrollbackAppend(childInstance *instance, const char *buf, size_t len);
+outputChunk * scrollbackReplay(childInstance *instance, bool readonly);
+bool parseScrollbackSize(const char *arg);
+bool parseScrollbackTo(const char *arg);
+
+// Call this to collect exited children (marks the process item dead)
+void reapChildren();
 
 // Call this to add the item to the list of connections
 void AddConnection(connectionItem *);
 void DeleteConnection(connectionItem *ci);
+// Call this after the fd or read/write interest of a listed connection has changed
+void UpdateConnection(connectionItem *ci);
 
 // connectionItems are made in class factories so none of the
 // constructors are public:
 
 // processFactory creates the process that we are managing
-connectionItem * processFactory(char *exe, char *argv[]);
-bool processFactoryNeedsRestart(); // Call to test status of the server process
-void processFactorySendSignal(int signal);
+connectionItem * processFactory(childInstance *instance);
+bool processFactoryNeedsRestart(childInstance *instance); // Call to test status of the server process
+bool processFactoryNeedsRestart(); // True if any instance's child is due to be started
+void processFactoryRecheck(); // Call when the restart conditions of a child have changed
+void processFactorySendSignal(childInstance *instance, int signal);
+bool processFactoryHasPidfd(); // True if the child's exit can be watched through a pidfd
 
 // clientFactory manages an open socket connected to a user
-connectionItem * clientFactory(int ioSocket, bool readonly=false);
+connectionItem * clientFactory(int ioSocket, bool readonly, childInstance *instance);
+// Call this when the connection greeting has to change (child state, restart mode)
+void bannerChanged(childInstance *instance);
+// What to do with clients whose output queue is full [users, loggers]
+extern OverflowPolicy overflowPolicy[2];
+extern size_t clientQueueSize;
+bool parseOverflowPolicy(const char *arg, bool logger);
+bool parseClientQueueSize(const char *arg);
+
+// metricsFactory manages an open socket connected to a metrics reader
+connectionItem * metricsFactory(int ioSocket, bool readonly, childInstance *instance);
+
+typedef connectionItem * (*connectionFactory)(int ioSocket, bool readonly,
+                                              childInstance *instance);
 
 // acceptFactory opens a socket creating the inital listening
-// service and calls clientFactory when clients are accepted
+// service and calls clientFactory (or factory) when clients are accepted
 // local: restrict to localhost (127.0.0.1)
 // readonly: discard any input from the client
-connectionItem * acceptFactory( const char *spec, bool local=true, bool readonly=false );
+// instance: the child instance the connections belong to
+connectionItem * acceptFactory( const char *spec, bool local=true, bool readonly=false,
+                                connectionFactory factory=clientFactory,
+                                childInstance *instance=NULL );
 
 extern connectionItem * processItem; // Set if it exists
  
@@ -114,15 +184,33 @@ public:
     // Called from main() when input from this client is ready to be read.
     virtual void readFromFd(void) = 0;
 
+    // Called from main() when this client's fd is ready for writing
+    // (only if wantsWrite() is true)
+    virtual void flushToFd(void) {}
+
     // Send characters to this client.
     virtual int Send(const char * message, int count) = 0;
-    virtual int Send(const char * stamp, int stamp_len,
-                     const char * message, int count) { return Send(message, count); }
+    // Send party line output (shared between all clients)
+    virtual int Send(sharedOutput &out);
 
     virtual void markDeadIfChildIs(pid_t pid);   // called if parent receives sig child
 
     int getFd() const { return _fd; }
     bool IsDead() const { return _markedForDeletion; }
+    bool wantsWrite() const { return _wantWrite; }
+    bool wantsRead() const { return _wantRead; }
+
+    // Backpressure: stop reading input from this connection until
+    // resumeInput() is called
+    void pauseInput();
+    // Resume reading input on all paused connections of an instance
+    // (that do not have to stay paused)
+    static void resumeInput(childInstance *instance);
+    // True while the reason for pausing the input of this connection holds
+    virtual bool stayPaused() const { return false; }
+    // True while this connection wants the party line output to stop
+    // (overflow policy "block")
+    virtual bool blocksOutput() const { return false; }
 
     // Return false unless you are the process item (processClass overloads)
     virtual bool isProcess() const { return false; }
@@ -130,16 +218,31 @@ public:
 
     virtual void writeAddress(std::ostream& fp) {}
     virtual void writeAddressEnv(std::ostringstream& env_var) {}
+    // Fill in the counters of a client connection (false if this is not one)
+    virtual bool getClientMetrics(clientMetrics &m) const { return false; }
 protected:
-    connectionItem ( int fd = -1, bool readonly = false );
+    connectionItem ( int fd = -1, bool readonly = false, childInstance *instance = NULL );
     int _fd;                 // File descriptor of this connection
     bool _markedForDeletion; // True if this connection is dead
     bool _readonly;          // True if input has to be ignored
     bool _log_stamp_sent;    // Flag for timestamping log output
+    bool _wantWrite;         // True if output is waiting for the fd to be writable
+    bool _wantRead;          // False while input is paused (backpressure)
+
+    void setWantWrite(bool want);
+    // Flag this connection for deletion (by the main loop's housekeeping)
+    void markDead() { _markedForDeletion = true; deadPending = true; }
 
 public:
     connectionItem * next,*prev;
     static connectionItem *head;
+    static bool deadPending;  // True if connections are waiting for deletion
+    childInstance *instance; // Child instance this connection belongs to (if any)
+    connectionItem *memberNext,*memberPrev;  // Party line of the instance
+    int watchedFd;           // fd as registered with the event loop
+    bool watchedWrite;       // write interest as registered with the event loop
+    bool watchedRead;        // read interest as registered with the event loop
+    std::string source;      // Peer address or uid (accepted client connections)
 
 private:
     // This should never happen
@@ -0,0 +1,572 @@
+// Process server for soft ioc - benchmark
+// Ralph Lange <ralph.lange@gmx.de> 2007-2019
+// GNU Public License (GPLv3) applies - see www.gnu.org
+
+// Runs procServ with a synthetic child that prints time stamped lines
+// at a given rate, attaches a number of telnet (TCP) and UNIX socket
+// clients (some of them deliberately slow), and reports end-to-end
+// throughput, pty-to-client latency, CPU time and syscalls of procServ.
+// Everything runs on localhost.
+
+#include <vector>
+#include <string>
+#include <algorithm>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "libtelnet.h"
+
+#define END_MARKER "BENCH-END"
+
+static const char *procServPath = "./procServ";
+static double duration = 10.0;          // Seconds of child output
+static long   rate = 5*1024*1024;       // Child output [bytes/s]
+static int    minLen = 20, maxLen = 200; // Line length range
+static int    nTcp = 4;                 // Telnet (TCP) clients
+static int    nUnix = 2;                // UNIX socket clients
+static int    nSlow = 1;                // Slow clients (of the above)
+static bool   withLog = false;          // Write a log file
+
+static unsigned long long nowNs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void sleepNs(unsigned long long ns)
+{
+    struct timespec ts;
+    ts.tv_sec = ns / 1000000000ull;
+    ts.tv_nsec = ns % 1000000000ull;
+    while (nanosleep(&ts, &ts) == -1 && errno == EINTR);
+}
+
+static void writeAll(int fd, const char *buf, size_t len)
+{
+    ssize_t n;
+    while (len) {
+        n = write(fd, buf, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return;
+        }
+        buf += n;
+        len -= n;
+    }
+}
+
+// The synthetic child: prints lines "T<ns> <seq> xxx..." at the given rate
+static int runChild()
+{
+    char buf[8192];
+    size_t len = 0;
+    unsigned long long start = nowNs(), end = start + (unsigned long long) (duration * 1e9);
+    unsigned long long sent = 0, seq = 0, t;
+
+    srand(4711);
+    while ((t = nowNs()) < end) {
+        // Throttle: stay behind rate
+        // Lines are only collected while behind; before sleeping, the
+        // buffer is written so that it does not add to the measured latency
+        unsigned long long due = start + (unsigned long long) (sent * 1e9 / rate);
+        if (due > t) {
+            if (len) {
+                writeAll(1, buf, len);
+                len = 0;
+            }
+            sleepNs(due - t);
+        }
+
+        int target = minLen + (maxLen > minLen ? rand() % (maxLen - minLen + 1) : 0);
+        int n = snprintf(buf + len, sizeof(buf) - len, "T%llu %llu ", nowNs(), seq++);
+        while (n < target - 1) buf[len + n++] = 'x';
+        buf[len + n++] = '\n';
+        len += n;
+        sent += n;
+
+        if (len > sizeof(buf) - maxLen - 64) {
+            writeAll(1, buf, len);
+            len = 0;
+        }
+    }
+    len += snprintf(buf + len, sizeof(buf) - len, END_MARKER "\n");
+    writeAll(1, buf, len);
+    while (1) pause();
+    return 0;
+}
+
+struct client {
+    int fd;
+    bool unixSock;
+    bool slow;
+    bool done;                          // End marker seen
+    bool closed;                        // Connection closed by procServ
+    unsigned long long bytes;
+    unsigned long long lines;
+    unsigned long long nextRead;        // Slow clients: time of next read
+    std::string partial;                // Incomplete line
+};
+
+struct procStats {
+    unsigned long long cpuTicks;
+    unsigned long long syscr, syscw;
+};
+
+static bool readProcStats(pid_t pid, procStats *ps)
+{
+    char path[64], buf[1024];
+    FILE *fp;
+
+    memset(ps, 0, sizeof(*ps));
+    snprintf(path, sizeof(path), "/proc/%ld/stat", (long) pid);
+    if (!(fp = fopen(path, "r"))) return false;
+    if (fgets(buf, sizeof(buf), fp)) {
+        // Fields after the command name (which may contain blanks)
+        char *p = strrchr(buf, ')');
+        unsigned long utime = 0, stime = 0;
+        if (p && sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+                        &utime, &stime) == 2)
+            ps->cpuTicks = utime + stime;
+    }
+    fclose(fp);
+
+    snprintf(path, sizeof(path), "/proc/%ld/io", (long) pid);
+    if ((fp = fopen(path, "r"))) {
+        while (fgets(buf, sizeof(buf), fp)) {
+            sscanf(buf, "syscr: %llu", &ps->syscr);
+            sscanf(buf, "syscw: %llu", &ps->syscw);
+        }
+        fclose(fp);
+    }
+    return true;
+}
+
+// Connect to the endpoints that procServ wrote into its info file
+static int connectTo(const std::string &spec)
+{
+    int fd;
+    if (spec.compare(0, 5, "unix:") == 0) {
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        strncpy(addr.sun_path, spec.c_str() + 5, sizeof(addr.sun_path) - 1);
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0 || connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) return -1;
+    } else {
+        struct sockaddr_in addr;
+        unsigned A[4], port;
+        if (sscanf(spec.c_str(), "tcp:%u.%u.%u.%u:%u", &A[0], &A[1], &A[2], &A[3], &port) != 5)
+            return -1;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        addr.sin_port = htons(port);
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd < 0 || connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) return -1;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    return fd;
+}
+
+// Scan received data for complete lines, collect latencies
+static void scanLines(client &c, const char *buf, size_t len,
+                      std::vector<unsigned long long> *latencies)
+{
+    unsigned long long t = nowNs();
+    c.partial.append(buf, len);
+    size_t start = 0, nl;
+    while ((nl = c.partial.find('\n', start)) != std::string::npos) {
+        const char *line = c.partial.c_str() + start;
+        if (line[0] == 'T') {
+            c.lines++;
+            if (latencies) {
+                unsigned long long stamp = strtoull(line + 1, NULL, 10);
+                if (stamp && stamp <= t) latencies->push_back(t - stamp);
+            }
+        } else if (strncmp(line, END_MARKER, strlen(END_MARKER)) == 0) {
+            c.done = true;
+        }
+        start = nl + 1;
+    }
+    c.partial.erase(0, start);
+}
+
+// Microbenchmarks
+// IAC escaping in telnet_send() on typical console output (no IACs),
+// and input processing in telnet_recv() on pasted input, compared to
+// the byte-by-byte scans they used to do
+
+static size_t microBytes;
+
+static void countSent(telnet_t *telnet, telnet_event_t *ev, void *user)
+{
+    if (ev->type == TELNET_EV_SEND || ev->type == TELNET_EV_DATA)
+        *(size_t *) user += ev->data.size;
+}
+
+// The DATA state loop of _process()
+static void scalarRecv(telnet_t *telnet, const char *buffer, size_t size)
+{
+    static volatile int nvtEol = 0;
+    telnet_event_t ev;
+    size_t i, start;
+
+    ev.type = TELNET_EV_DATA;
+    for (i = start = 0; i != size; ++i) {
+        unsigned char byte = buffer[i];
+        if (byte == TELNET_IAC || (byte == '\r' && nvtEol)) {
+            if (i != start) {
+                ev.data.buffer = buffer + start;
+                ev.data.size = i - start;
+                countSent(telnet, &ev, &microBytes);
+            }
+            start = i + 1;
+        }
+    }
+    if (i != start) {
+        ev.data.buffer = buffer + start;
+        ev.data.size = i - start;
+        countSent(telnet, &ev, &microBytes);
+    }
+}
+
+static void scalarSend(telnet_t *telnet, const char *buffer, size_t size)
+{
+    size_t i, l;
+    for (l = i = 0; i != size; ++i) {
+        if (buffer[i] == (char) TELNET_IAC) {
+            if (i != l) telnet_send(telnet, buffer + l, i - l);
+            l = i + 1;
+            telnet_iac(telnet, TELNET_IAC);
+        }
+    }
+    if (i != l) telnet_send(telnet, buffer + l, i - l);
+}
+
+static double timeSend(void (*send)(telnet_t *, const char *, size_t),
+                       telnet_t *telnet, const std::vector<char> &buf,
+                       size_t chunk, int rounds)
+{
+    unsigned long long t = nowNs();
+    for (int r = 0; r < rounds; r++)
+        for (size_t off = 0; off < buf.size(); off += chunk)
+            send(telnet, &buf[off], std::min(chunk, buf.size() - off));
+    return (nowNs() - t) / 1e9;
+}
+
+static int runMicro()
+{
+    static const telnet_telopt_t telopts[] = { { -1, 0, 0 } };
+    std::vector<char> buf;
+    char line[256];
+
+    // 1 MB of console-like output
+    srand(4711);
+    for (int i = 0; buf.size() < 1024*1024; i++) {
+        int n = snprintf(line, sizeof(line), "%s:ai%d VAL: %d.%03d STAT: NO_ALARM SEVR: NO_ALARM ",
+                         "IOC:sys", i, rand() % 1000, rand() % 1000);
+        int target = minLen + (maxLen > minLen ? rand() % (maxLen - minLen + 1) : 0);
+        while (n < target - 2 && n < (int) sizeof(line) - 2) line[n++] = 'a' + rand() % 26;
+        line[n++] = '\r';
+        line[n++] = '\n';
+        buf.insert(buf.end(), line, line + n);
+    }
+
+    telnet_t *telnet = telnet_init(telopts, countSent, 0, &microBytes);
+    const size_t chunks[] = { 64, 1600, 65536 };
+    const int rounds = 200;
+    double mb = rounds * buf.size() / (1024.0 * 1024.0);
+
+    printf("telnet_send() IAC escaping, %.0f MB of console output (lines %d..%d bytes)\n",
+           mb, minLen, maxLen);
+    for (size_t i = 0; i < sizeof(chunks) / sizeof(chunks[0]); i++) {
+        double scalar = timeSend(scalarSend, telnet, buf, chunks[i], rounds);
+        double fast = timeSend(telnet_send, telnet, buf, chunks[i], rounds);
+        printf("  %6lu byte calls:  byte scan %8.1f MB/s   telnet_send %8.1f MB/s   (x%.1f)\n",
+               (unsigned long) chunks[i], mb / scalar, mb / fast, scalar / fast);
+    }
+
+    printf("telnet_recv() input processing, %.0f MB of pasted input\n", mb);
+    for (size_t i = 0; i < sizeof(chunks) / sizeof(chunks[0]); i++) {
+        double scalar = timeSend(scalarRecv, telnet, buf, chunks[i], rounds);
+        double fast = timeSend(telnet_recv, telnet, buf, chunks[i], rounds);
+        printf("  %6lu byte calls:  byte scan %8.1f MB/s   telnet_recv %8.1f MB/s   (x%.1f)\n",
+               (unsigned long) chunks[i], mb / scalar, mb / fast, scalar / fast);
+    }
+    telnet_free(telnet);
+    return 0;
+}
+
+static void usage(const char *name)
+{
+    printf("Usage: %s [options]\n"
+           "Options:\n"
+           " -p <path>      procServ binary to test (default: ./procServ)\n"
+           " -d <sec>       duration of child output (default: 10)\n"
+           " -r <n>[k|M]    child output rate [bytes/s] (default: 5M)\n"
+           " -l <min>:<max> line length range (default: 20:200)\n"
+           " -t <n>         number of telnet (TCP) clients (default: 4)\n"
+           " -u <n>         number of UNIX socket clients (default: 2)\n"
+           " -s <n>         number of slow clients among them (default: 1)\n"
+           " -L             make procServ write a log file\n"
+           " -m             run the microbenchmarks instead (telnet_send/recv)\n",
+           name);
+}
+
+static double percentile(std::vector<unsigned long long> &v, double p)
+{
+    if (v.empty()) return 0.0;
+    size_t i = (size_t) (p / 100.0 * (v.size() - 1));
+    return v[i] / 1000.0;
+}
+
+int main(int argc, char *argv[])
+{
+    int c;
+    char *end;
+
+    if (argc > 1 && strcmp(argv[1], "--child") == 0) {
+        // Child mode: procServBench --child <duration> <rate> <min> <max>
+        if (argc < 6) return 1;
+        duration = atof(argv[2]);
+        rate = atol(argv[3]);
+        minLen = atoi(argv[4]);
+        maxLen = atoi(argv[5]);
+        return runChild();
+    }
+
+    bool micro = false;
+    while ((c = getopt(argc, argv, "p:d:r:l:t:u:s:Lmh")) != -1) {
+        switch (c) {
+        case 'p': procServPath = optarg; break;
+        case 'd': duration = atof(optarg); break;
+        case 'r':
+            rate = strtol(optarg, &end, 10);
+            if (*end == 'k' || *end == 'K') rate *= 1024;
+            else if (*end == 'M') rate *= 1024*1024;
+            break;
+        case 'l':
+            if (sscanf(optarg, "%d:%d", &minLen, &maxLen) != 2) minLen = maxLen = atoi(optarg);
+            break;
+        case 't': nTcp = atoi(optarg); break;
+        case 'u': nUnix = atoi(optarg); break;
+        case 's': nSlow = atoi(optarg); break;
+        case 'L': withLog = true; break;
+        case 'm': micro = true; break;
+        default:
+            usage(argv[0]);
+            return c == 'h' ? 0 : 1;
+        }
+    }
+    if (minLen < 40) minLen = 40;       // Room for the time stamp
+    if (maxLen < minLen) maxLen = minLen;
+    if (micro) return runMicro();
+    if (rate <= 0 || duration <= 0 || nTcp + nUnix < 1 || nSlow >= nTcp + nUnix) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    char dir[] = "/tmp/procServBench.XXXXXX";
+    if (!mkdtemp(dir)) {
+        perror("mkdtemp");
+        return 1;
+    }
+    std::string sdir(dir);
+    std::string pidFile = sdir + "/pid", infoFile = sdir + "/info";
+    std::string logFile = sdir + "/log", unixSpec = "unix:" + sdir + "/sock";
+
+    char self[4096];
+    ssize_t n = readlink("/proc/self/exe", self, sizeof(self) - 1);
+    if (n <= 0) {
+        perror("readlink");
+        return 1;
+    }
+    self[n] = '\0';
+
+    char sDuration[32], sRate[32], sMin[16], sMax[16];
+    snprintf(sDuration, sizeof(sDuration), "%g", duration);
+    snprintf(sRate, sizeof(sRate), "%ld", rate);
+    snprintf(sMin, sizeof(sMin), "%d", minLen);
+    snprintf(sMax, sizeof(sMax), "%d", maxLen);
+
+    // Start procServ, waiting for a manual start of the child
+    std::vector<const char *> args;
+    args.push_back(procServPath);
+    args.push_back("-q");
+    args.push_back("--wait");
+    args.push_back("-p"); args.push_back(pidFile.c_str());
+    args.push_back("-I"); args.push_back(infoFile.c_str());
+    if (withLog) { args.push_back("-L"); args.push_back(logFile.c_str()); }
+    args.push_back("-P"); args.push_back("0");
+    // The slow clients must not hold up the others
+    args.push_back("--user-overflow"); args.push_back("drop");
+    args.push_back("-P"); args.push_back(unixSpec.c_str());
+    args.push_back(self);
+    args.push_back("--child");
+    args.push_back(sDuration);
+    args.push_back(sRate);
+    args.push_back(sMin);
+    args.push_back(sMax);
+    args.push_back(NULL);
+
+    pid_t starter = fork();
+    if (starter == 0) {
+        execv(procServPath, (char * const *) &args[0]);
+        perror("execv");
+        _exit(1);
+    }
+    waitpid(starter, NULL, 0);
+
+    // Wait for the info file (written after daemonizing)
+    std::string tcpSpec;
+    pid_t serverPid = 0;
+    for (int i = 0; i < 100 && (tcpSpec.empty() || !serverPid); i++) {
+        FILE *fp = fopen(infoFile.c_str(), "r");
+        if (fp) {
+            char line[512];
+            while (fgets(line, sizeof(line), fp)) {
+                line[strcspn(line, "\n")] = '\0';
+                if (strncmp(line, "pid:", 4) == 0) serverPid = atol(line + 4);
+                if (strncmp(line, "tcp:", 4) == 0) tcpSpec = line;
+            }
+            fclose(fp);
+        }
+        if (tcpSpec.empty() || !serverPid) sleepNs(50000000ull);
+    }
+    if (tcpSpec.empty() || !serverPid) {
+        fprintf(stderr, "procServ did not come up (no info file %s)\n", infoFile.c_str());
+        return 1;
+    }
+
+    // Attach clients: fast ones first, the slow ones last
+    std::vector<client> clients(nTcp + nUnix);
+    for (size_t i = 0; i < clients.size(); i++) {
+        client &cl = clients[i];
+        cl.unixSock = (int) i >= nTcp;
+        cl.slow = i >= clients.size() - nSlow;
+        cl.done = cl.closed = false;
+        cl.bytes = cl.lines = cl.nextRead = 0;
+        cl.fd = connectTo(cl.unixSock ? unixSpec : tcpSpec);
+        if (cl.fd < 0) {
+            fprintf(stderr, "Can't connect to %s: %s\n",
+                    cl.unixSock ? unixSpec.c_str() : tcpSpec.c_str(), strerror(errno));
+            kill(serverPid, SIGTERM);
+            return 1;
+        }
+    }
+    sleepNs(200000000ull);              // Let procServ greet everybody
+
+    procStats before, after;
+    readProcStats(serverPid, &before);
+
+    // Start the child (^R)
+    unsigned long long t0 = nowNs(), tEnd = 0;
+    writeAll(clients[0].fd, "\x12", 1);
+
+    std::vector<unsigned long long> latencies;
+    latencies.reserve(1000000);
+    unsigned long long deadline = t0 + (unsigned long long) ((duration + 10) * 1e9);
+    char buf[65536];
+
+    while (nowNs() < deadline) {
+        std::vector<struct pollfd> pfds;
+        std::vector<size_t> idx;
+        bool fastDone = true;
+        unsigned long long t = nowNs();
+
+        for (size_t i = 0; i < clients.size(); i++) {
+            client &cl = clients[i];
+            if (!cl.slow && !cl.done && !cl.closed) fastDone = false;
+            if (cl.closed || (cl.slow && cl.nextRead > t)) continue;
+            struct pollfd p = { cl.fd, POLLIN, 0 };
+            pfds.push_back(p);
+            idx.push_back(i);
+        }
+        if (fastDone) break;
+        if (poll(pfds.empty() ? NULL : &pfds[0], pfds.size(), 10) <= 0) continue;
+
+        for (size_t j = 0; j < pfds.size(); j++) {
+            if (!pfds[j].revents) continue;
+            client &cl = clients[idx[j]];
+            // Slow clients take 1 kB every 20 ms
+            ssize_t len = read(cl.fd, buf, cl.slow ? 1024 : sizeof(buf));
+            if (len <= 0) {
+                if (len < 0 && (errno == EAGAIN || errno == EINTR)) continue;
+                cl.closed = true;
+                continue;
+            }
+            cl.bytes += len;
+            if (cl.slow) cl.nextRead = nowNs() + 20000000ull;
+            bool wasDone = cl.done;
+            scanLines(cl, buf, len, idx[j] == 0 ? &latencies : NULL);
+            if (idx[j] == 0 && cl.done && !wasDone) tEnd = nowNs();
+        }
+    }
+    if (!tEnd) tEnd = nowNs();
+
+    readProcStats(serverPid, &after);
+    kill(serverPid, SIGTERM);
+    sleepNs(200000000ull);
+
+    // Report
+    double secs = (tEnd - t0) / 1e9;
+    double mb = clients[0].bytes / (1024.0 * 1024.0);
+    double cpuMs = (after.cpuTicks - before.cpuTicks) * 1000.0 / sysconf(_SC_CLK_TCK);
+    unsigned long long fastBytes = 0;
+    int nFast = 0, slowClosed = 0;
+
+    for (size_t i = 0; i < clients.size(); i++) {
+        if (clients[i].slow) {
+            if (clients[i].closed) slowClosed++;
+        } else {
+            fastBytes += clients[i].bytes;
+            nFast++;
+        }
+    }
+    std::sort(latencies.begin(), latencies.end());
+
+    printf("procServ benchmark: %s\n", procServPath);
+    printf("  child output:      %ld bytes/s for %g s, lines %d..%d bytes\n",
+           rate, duration, minLen, maxLen);
+    printf("  clients:           %d telnet, %d unix (%d slow)%s\n",
+           nTcp, nUnix, nSlow, withLog ? ", log file" : "");
+    printf("  elapsed:           %.3f s (until the end marker reached client 0)\n", secs);
+    printf("  lines (client 0):  %llu%s\n", clients[0].lines,
+           clients[0].done ? "" : " (end marker NOT seen)");
+    printf("  throughput:        %.2f MB/s per fast client, %.2f MB/s total\n",
+           nFast ? fastBytes / (1024.0 * 1024.0) / nFast / secs : 0.0,
+           fastBytes / (1024.0 * 1024.0) / secs);
+    printf("  latency [us]:      p50 %.1f  p90 %.1f  p99 %.1f  p99.9 %.1f  max %.1f\n",
+           percentile(latencies, 50), percentile(latencies, 90),
+           percentile(latencies, 99), percentile(latencies, 99.9),
+           percentile(latencies, 100));
+    printf("  procServ CPU:      %.0f ms, %.1f ms/MB\n", cpuMs, mb > 0 ? cpuMs / mb : 0.0);
+    printf("  procServ syscalls: %llu read, %llu write (%.0f / %.0f per MB)\n",
+           after.syscr - before.syscr, after.syscw - before.syscw,
+           mb > 0 ? (after.syscr - before.syscr) / mb : 0.0,
+           mb > 0 ? (after.syscw - before.syscw) / mb : 0.0);
+    printf("  slow clients:      %d of %d disconnected\n", slowClosed, nSlow);
+
+    for (size_t i = 0; i < clients.size(); i++) close(clients[i].fd);
+    unlink(pidFile.c_str());
+    unlink(infoFile.c_str());
+    unlink(logFile.c_str());
+    rmdir(dir);
+    return clients[0].done ? 0 : 1;
+}
@@ -8,31 +8,50 @@
 #define processClassH
 
 #include "procServ.h"
+#include "childInstance.h"
+#include "outputQueue.h"
 
 #ifdef __CYGWIN__
 #include <windows.h>
 #endif /* __CYGWIN__ */
 
+// Size of the queue for input to the child: clients sending input are
+// paused when it is full, and resumed when it has drained to half of it
+#define PTY_QUEUE_SIZE (64*1024)
+
 class processClass : public connectionItem
 {
-friend connectionItem * processFactory(char *exe, char *argv[]);
-friend bool processFactoryNeedsRestart();
-friend void processFactorySendSignal(int signal);
+friend connectionItem * processFactory(childInstance *instance);
+friend void processFactorySendSignal(childInstance *instance, int signal);
 public:
-    processClass(char *exe, char *argv[]);
+    processClass(childInstance *instance);
     void readFromFd(void);
     int Send(const char *,int);
-    void markDeadIfChildIs(pid_t pid) { if (pid==_pid) _markedForDeletion=true; }
+    void flushToFd(void);
+    void markDeadIfChildIs(pid_t pid) { if (pid==_pid) markDead(); }
     char factoryName[100];
     virtual bool isProcess() const { return true; }
     virtual bool isLogger() const { return false; }
-    static void restartOnce ();
-    static bool exists() { return _runningItem ? true : false; }
+    static void restartOnce (childInstance *instance);
+    // Input waiting for the child to read it (senders get paused when full)
+    static size_t inputQueued(const childInstance *instance)
+        { return instance->process ? instance->process->_inputQueue.bytes() : 0; }
+    static bool inputFull(const childInstance *instance)
+        { return inputQueued(instance) >= PTY_QUEUE_SIZE; }
+    // Stop reading the child's output while a client blocks it
+    static void holdOutput(childInstance *instance)
+        { if (instance->process) instance->process->pauseInput(); }
+    bool stayPaused() const;
     virtual ~processClass();
 protected:
     pid_t _pid;
-    static processClass * _runningItem;
-    static time_t _restartTime;
+    char *_readBuf;             // Output of the child, read in batches
+    size_t _readBufSize;        // Current (adaptive) size of _readBuf
+    char *_sendBuf;             // Filtered input for the child (reused)
+    size_t _sendBufSize;
+    outputQueue _inputQueue;    // Input waiting for the pty to become writable
+    unsigned char _ignore[32];  // Bitmap of the chars to ignore (--ignore)
+    bool _ignoring;
     void terminateJob();
 #ifdef __CYGWIN__
     HANDLE _hwinjob;
@@ -16,6 +16,8 @@
 #include <time.h>
 #include <string.h>
 #include <strings.h>
+#include <fcntl.h>
+#include <sys/syscall.h>
 
 #ifdef __CYGWIN__
 #include <sys/cygwin.h>
@@ -37,42 +39,113 @@ extern "C" int forkpty(int*, char*, void*, void*);
 
 #include "procServ.h"
 #include "processClass.h"
+#include "eventLoop.h"
+#include "metrics.h"
 
-#define LINEBUF_LENGTH 1024
+// Child output is read until EAGAIN into a buffer that grows (up to
+// the max. size) while the child keeps filling it, and shrinks back
+// when the output gets sparse
+#define READBUF_MIN_SIZE 4096
+#define READBUF_MAX_SIZE (64*1024)
 
 static void hideWindow();
 
-processClass * processClass::_runningItem=NULL;
-time_t processClass::_restartTime=0;
+#ifdef SYS_pidfd_open
+// Watches a pidfd, which becomes readable when the child exits
+// (Linux >= 5.3), so that the exit is noticed without any delay
+class childExitItem : public connectionItem
+{
+public:
+    childExitItem(int pidfd) : connectionItem(pidfd) {}
+    void readFromFd(void) {
+        PRINTF("childExitItem: child exited\n");
+        reapChildren();
+        markDead();
+    }
+    int Send(const char *, int) { return 0; }
+};
+#endif /* SYS_pidfd_open */
 
-bool processFactoryNeedsRestart()
+bool processFactoryHasPidfd()
+{
+#ifdef SYS_pidfd_open
+    static int supported = -1;
+    if (supported < 0) {
+        int fd = syscall(SYS_pidfd_open, getpid(), 0);
+        supported = fd >= 0;
+        if (fd >= 0) close(fd);
+    }
+    return supported;
+#else
+    return false;
+#endif
+}
+
+// The instances are only checked for a child to (re)start after
+// something has changed: a child went away, a restart command, a
+// restart mode toggle, or the holdoff time of an instance is over
+// (its restartTimer calls processFactoryRecheck)
+static bool restartCheck = true;
+
+void processFactoryRecheck()
+{
+    restartCheck = true;
+}
+
+bool processFactoryNeedsRestart(childInstance *in)
 {
     time_t now = time(0);
-    if ( ( restartMode == norestart && processClass::_restartTime ) ||
-         processClass::_runningItem ||
-         now < processClass::_restartTime ||
-         waitForManualStart ) return false;
+    if ( ( in->restartMode == norestart && in->restartTime ) ||
+         in->process ||
+         in->childPid ||            // Old child not reaped yet
+         in->finished ||
+         in->waitForManualStart ) return false;
+    if ( now < in->restartTime ) {
+        if ( !in->restartTimer.armed() )
+            in->restartTimer.armIn( (in->restartTime - now) * 1000 );
+        return false;
+    }
     return true;
 }
 
-connectionItem * processFactory(char *exe, char *argv[])
+bool processFactoryNeedsRestart()
+{
+    if ( !restartCheck ) return false;
+    for ( childInstance *in = childInstance::head; in; in = in->next )
+        if ( processFactoryNeedsRestart(in) ) return true;
+    restartCheck = false;       // Nothing due (the holdoff timers are armed)
+    return false;
+}
+
+connectionItem * processFactory(childInstance *in)
 {
     const size_t BUFLEN = 512;
     char buf[BUFLEN];
-    time(&IOCStart); // Remember when we did this
+    time(&in->IOCStart); // Remember when we did this
 
-    if (processFactoryNeedsRestart())
+    if (processFactoryNeedsRestart(in))
     {
-    snprintf(buf, BUFLEN, "@@@ Restarting child \"%s\"" NL, childName);
-	SendToAll( buf, strlen(buf), 0 );
+    snprintf(buf, BUFLEN, "@@@ Restarting child \"%s\"" NL, in->childName);
+	SendToAll( buf, strlen(buf), 0, in );
 
-        if ( strcmp( childName, argv[0] ) != 0 ) {
-            snprintf(buf, BUFLEN, "@@@    (as %s)" NL, argv[0]);
-            SendToAll( buf, strlen(buf), 0 );
+        if ( strcmp( in->childName, in->childArgv[0] ) != 0 ) {
+            snprintf(buf, BUFLEN, "@@@    (as %s)" NL, in->childArgv[0]);
+            SendToAll( buf, strlen(buf), 0, in );
         }
 
-        connectionItem *ci = new processClass(exe, argv);
+        processClass *ci = new processClass(in);
         PRINTF("Created new child connection (processClass %p)\n", ci);
+#ifdef SYS_pidfd_open
+        if (ci->_pid > 0 && processFactoryHasPidfd()) {
+            int pidfd = syscall(SYS_pidfd_open, ci->_pid, 0);
+            if (pidfd >= 0) {
+                AddConnection(new childExitItem(pidfd));
+            } else {
+                // (SIGCHLD still gets it reaped)
+                fprintf(stderr, "%s: pidfd_open failed: %s\n", procservName, strerror(errno));
+            }
+        }
+#endif /* SYS_pidfd_open */
 	return ci;
     }
     else
@@ -101,23 +174,30 @@ processClass::~processClass()
         now_buf[NOWLEN-1] = '\0';
     }
     snprintf (goodbye, BYELEN, "@@@ Child process is shutting down, %s" NL,
-              restartMode == restart ? "a new one will be restarted shortly" :
-              (restartMode == norestart ? "auto restart is disabled" :
-                                          "oneshot mode: server will exit"));
+              instance->restartMode == restart ? "a new one will be restarted shortly" :
+              (instance->restartMode == norestart ? "auto restart is disabled" :
+               childInstance::count == 1 ? "oneshot mode: server will exit" :
+                                           "oneshot mode: it will not be restarted"));
 
     // Update client connect message
-    snprintf(infoMessage2, INFO2LEN, "@@@ Child \"%s\" is SHUT DOWN" NL, childName);
+    snprintf(instance->infoMessage2, INFO2LEN, "@@@ Child \"%s\" is SHUT DOWN" NL,
+             instance->childName);
+    bannerChanged(instance);
 
     SendToAll( now_buf, strlen(now_buf), this );
     SendToAll( goodbye, strlen(goodbye), this );
-    if (restartMode != oneshot)
-        SendToAll( infoMessage3, strlen(infoMessage3), this );
+    if (instance->restartMode != oneshot)
+        SendToAll( instance->infoMessage3, strlen(instance->infoMessage3), this );
 
                                 // Negative PID sends signal to all members of process group
     if ( _pid > 0 ) kill( -_pid, SIGKILL );
     terminateJob();
     if ( _fd > 0 ) close( _fd );
-    _runningItem = NULL;
+    free( _readBuf );
+    free( _sendBuf );
+    instance->process = NULL;
+    processFactoryRecheck();
+    connectionItem::resumeInput(instance);
 }
 
 
@@ -126,9 +206,27 @@ processClass::~processClass()
 //    parent: sets the minimum time for the next restart
 //    child:  sets the coresize, becomes a process group leader,
 //            and does an execvp() with the command
-processClass::processClass(char *exe, char *argv[])
+processClass::processClass(childInstance *instance)
+    : connectionItem(-1, false, instance),
+    // Never drops input: senders are paused when PTY_QUEUE_SIZE is
+    // reached, so it is exceeded by one read per sender at most
+      _inputQueue((size_t) -1)
 {
-    _runningItem=this;
+    const char *ignChars = instance->ignChars;
+    instance->process = this;
+    _readBuf = NULL;
+    _readBufSize = READBUF_MIN_SIZE;
+    _sendBuf = NULL;
+    _sendBufSize = 0;
+
+                                // Compile the ignored chars into a bitmap
+    memset( _ignore, 0, sizeof(_ignore) );
+    _ignoring = ( ignChars != NULL );
+    if ( ignChars ) {
+        _ignore[0] = 1;         // NUL has always been ignored, too
+        for ( const unsigned char *c = (const unsigned char *) ignChars; *c; c++ )
+            _ignore[*c >> 3] |= 1 << ( *c & 7 );
+    }
     struct rlimit corelimit;
     const size_t BUFLEN = 128;
     char buf[BUFLEN];
@@ -155,7 +253,7 @@ processClass::processClass(char *exe, char *argv[])
 
     _pid = forkpty(&_fd, factoryName, NULL, NULL);
 
-    _markedForDeletion = _pid <= 0;
+    if (_pid <= 0) markDead();
 
     if (_pid) {                              // I am the parent
 
@@ -163,6 +261,8 @@ processClass::processClass(char *exe, char *argv[])
             fprintf(stderr, "Fork failed: %s\n", errno == ENOENT ? "No pty" : strerror(errno));
         } else {
             PRINTF("Created process %ld on %s\n", (long) _pid, factoryName);
+            metrics.childStarts++;
+            instance->counters.starts++;
         }
 
 #ifdef __CYGWIN__
@@ -184,13 +284,24 @@ processClass::processClass(char *exe, char *argv[])
         }
 #endif /* __CYGWIN__ */
 
+        // Reads must not block, they are done until EAGAIN
+        // (and the pty is not for the children of other instances)
+        if (_fd >= 0) {
+            fcntl(_fd, F_SETFL, fcntl(_fd, F_GETFL) | O_NONBLOCK);
+            fcntl(_fd, F_SETFD, FD_CLOEXEC);
+        }
+        if (_pid > 0) instance->childPid = _pid;
+
         // Don't start a new one before this time:
-        _restartTime = holdoffTime + time(0);
+        instance->restartTime = instance->holdoffTime + time(0);
 
         // Update client connect message
-        snprintf(infoMessage2, INFO2LEN, "@@@ Child \"%s\" PID: %ld" NL, childName, (long) _pid);
+        snprintf(instance->infoMessage2, INFO2LEN, "@@@ Child \"%s\" PID: %ld" NL,
+                 instance->childName, (long) _pid);
+        bannerChanged(instance);
 
-        snprintf(buf, BUFLEN, "@@@ The PID of new child \"%s\" is: %ld" NL, childName, (long) _pid);
+        snprintf(buf, BUFLEN, "@@@ The PID of new child \"%s\" is: %ld" NL,
+                 instance->childName, (long) _pid);
         SendToAll( buf, strlen(buf), this );
         strcpy(buf, "@@@ @@@ @@@ @@@ @@@" NL);
         SendToAll( buf, strlen(buf), this );
@@ -201,94 +312,188 @@ processClass::processClass(char *exe, char *argv[])
         sleep(1);   // to allow AssignProcessToJobObject() to happen - the process we spawn may spawn other processes so we want it to inherit
 #endif /* __CYGWIN__ */
 
+        sigset_t sigset_chld;                      // SIGCHLD may be blocked (see main())
+        sigemptyset(&sigset_chld);
+        sigaddset(&sigset_chld, SIGCHLD);
+        sigprocmask(SIG_UNBLOCK, &sigset_chld, NULL);
+
         setsid();                                  // Become process group leader
         hideWindow();                              // Close console window (on Cygwin)
-        if ( setCoreSize ) {                       // Set core size limit?
+        if ( instance->setCoreSize ) {             // Set core size limit?
             getrlimit( RLIMIT_CORE, &corelimit );
-            corelimit.rlim_cur = coreSize;
+            corelimit.rlim_cur = instance->coreSize;
             setrlimit( RLIMIT_CORE, &corelimit );
         }
-        if ( chDir && chdir( chDir ) ) {
+        setenv( "PROCSERV_INFO", instance->envInfo.c_str(), 1 );
+        if ( instance->chDir && chdir( instance->chDir ) ) {
             fprintf( stderr, "%s: child could not chdir to %s, %s\n",
-                     procservName, chDir, strerror(errno) );
+                     procservName, instance->chDir, strerror(errno) );
         } else {
-            execvp(exe, argv);              // execvp()
+            execvp(instance->childExec, instance->childArgv);  // execvp()
         }
 
 	// This shouldn't return, but did...
 	fprintf( stderr, "%s: child could not execute: %s, %s\n",
-                 procservName, *argv, strerror(errno) );
+                 procservName, *instance->childArgv, strerror(errno) );
 	exit( -1 );
     }
 }
 
 // processClass::readFromFd
-// Reads, checks for EOF/Error, and sends to the other connections
+// Reads until EAGAIN (or the buffer is full), checks for EOF/Error,
+// and sends everything to the other connections in one batch
 void processClass::readFromFd(void)
 {
-    char  buf[1600];
+    static bool reported;
+    char fallback[READBUF_MIN_SIZE + 1];
+    char *buf;
+    size_t size = _readBufSize, len = 0;
+    ssize_t status = 0;
+
+    if (!_readBuf) {
+        _readBufSize = size = READBUF_MIN_SIZE;
+        _readBuf = (char*) malloc(_readBufSize + 1);
+    }
+    buf = _readBuf;
+    if (!buf) {                 // Out of memory: go on with small reads
+        if (!reported) {
+            fprintf(stderr, "%s: out of memory, reading child output in small pieces\n",
+                    procservName);
+            reported = true;
+        }
+        buf = fallback;
+        size = READBUF_MIN_SIZE;
+    }
 
-    int len = read(_fd, buf, sizeof(buf)-1);
-    if (len < 0) {
+    while (len < size) {
+        status = read(_fd, buf + len, size - len);
+        metrics.ptyReads++;
+        if (status <= 0) break;
+        len += status;
+    }
+
+    if (len > 0) {
+        metrics.ptyBytesRead += len;
+        instance->counters.ptyBytesRead += len;
+        buf[len]='\0';
+        SendToAll(buf, len, this);
+    }
+
+    // Adapt the batch size (and the buffer) for the next time
+    if (_readBuf) {
+        size_t newSize = _readBufSize;
+        if (len == _readBufSize && _readBufSize < READBUF_MAX_SIZE) {
+            newSize *= 2;
+        } else if (len < _readBufSize / 4 && _readBufSize > READBUF_MIN_SIZE) {
+            newSize /= 2;
+        }
+        if (newSize != _readBufSize) {
+            char *p = (char*) realloc(_readBuf, newSize + 1);
+            if (p) {            // Else keep the current size
+                _readBuf = p;
+                _readBufSize = newSize;
+            }
+        }
+    }
+
+    if (status < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
         PRINTF("processItem: Got error reading input connection: %s\n", strerror(errno));
-        _markedForDeletion = true;
-    } else if (len == 0) {
+        markDead();
+    } else if (status == 0) {
         PRINTF("processItem: Got EOF reading input connection\n");
-        _markedForDeletion = true;
-    } else {
-        buf[len]='\0';
-        SendToAll(&buf[0], len, this);
+        markDead();
     }
 }
 
+#define IGNORED(c) ( _ignore[(unsigned char) (c) >> 3] & ( 1 << ( (c) & 7 ) ) )
+
 // Sanitize buffer, then send characters to child
+// Input that the pty does not take right away is queued and written
+// when the pty becomes writable (flushToFd)
 int processClass::Send( const char * buf, int count )
 {
-    int status = 0;
-    int i, j, ign = 0;
-    char buf3[LINEBUF_LENGTH+1];
-    char *buf2 = buf3;
-
-                                // Create working copy of buffer
-    if ( count > LINEBUF_LENGTH ) buf2 = (char*) calloc (count + 1, 1);
-    buf2[0] = '\0';
-
-    if ( ignChars ) {           // Throw out ignored chars
-        for ( i = j = 0; i < count; i++ ) {
-            if ( index( ignChars, (int) buf[i] ) == NULL ) {
-                buf2[j++] = buf[i];
-            } else ign++;
+    const char *data = buf;
+    int i, j;
+    ssize_t status = 0;
+
+    if ( count <= 0 ) return 0;
+
+    if ( _ignoring ) {          // Throw out ignored chars
+        for ( i = 0; i < count && !IGNORED(buf[i]); i++ );
+        if ( i < count ) {      // Filter into the reusable buffer
+            if ( _sendBufSize < (size_t) count ) {
+                free( _sendBuf );
+                _sendBuf = (char*) malloc( count );
+                _sendBufSize = _sendBuf ? count : 0;
+                if ( !_sendBuf ) {
+                    fprintf( stderr, "%s: out of memory, dropped %d bytes of input to the child\n",
+                             procservName, count );
+                    return -1;
+                }
+            }
+            memcpy( _sendBuf, buf, i );
+            for ( j = i; i < count; i++ ) {
+                _sendBuf[j] = buf[i];
+                j += !IGNORED(buf[i]);
+            }
+            data = _sendBuf;
+            count = j;
         }
-    } else {                    // Plain buffer copy
-        strncpy (buf2, buf, count);
     }
-        buf2[count - ign] = '\0';
-
-    if ( count > 0 )
-    {
-	status = write( _fd, buf2, count - ign );
-	if ( status < 0 ) _markedForDeletion = true;
+    if ( count == 0 ) return 0;
+
+    if ( _inputQueue.empty() ) {
+        while ( -1 == ( status = write( _fd, data, count ) ) && errno == EINTR );
+        if ( status < 0 ) {
+            if ( errno != EAGAIN && errno != EWOULDBLOCK ) {
+                PRINTF("processItem: Got error writing to child: %s\n", strerror(errno));
+                markDead();
+                return -1;
+            }
+            status = 0;
+        }
+    }
+    if ( status < count ) {
+        _inputQueue.push( data + status, count - status );
+        setWantWrite( true );
     }
+    return count;
+}
+
+bool processClass::stayPaused() const
+{
+    for ( connectionItem *p = instance->members; p; p = p->memberNext )
+        if ( p->blocksOutput() ) return true;
+    return false;
+}
 
-    if ( count > LINEBUF_LENGTH ) free( buf2 );
-    return status;
+void processClass::flushToFd(void)
+{
+    if ( _inputQueue.flush( _fd ) < 0 ) {
+        PRINTF("processItem: Got error writing to child: %s\n", strerror(errno));
+        _inputQueue.clear();
+        markDead();
+    }
+    if ( _inputQueue.empty() ) setWantWrite( false );
+    if ( _inputQueue.bytes() <= PTY_QUEUE_SIZE / 2 ) connectionItem::resumeInput(instance);
 }
 
 // The telnet state machine can call this to blast a running
 // client IOC
-void processFactorySendSignal(int signal)
+void processFactorySendSignal(childInstance *in, int signal)
 {
-    if (processClass::_runningItem) {
+    if (in->process) {
         PRINTF("Sending signal %d to pid %ld\n",
-               signal, (long) processClass::_runningItem->_pid);
-        kill(-processClass::_runningItem->_pid, signal);
-        if (signal == killSig) processClass::_runningItem->terminateJob();
+               signal, (long) in->process->_pid);
+        kill(-in->process->_pid, signal);
+        if (signal == in->killSig) in->process->terminateJob();
     }
 }
 
-void processClass::restartOnce ()
+void processClass::restartOnce (childInstance *instance)
 {
-    _restartTime = 0;
+    instance->restartTime = 0;
+    processFactoryRecheck();
 }
 
 void processClass::terminateJob()
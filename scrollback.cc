@@ -0,0 +1,129 @@
+// Process server for soft ioc
+// Ralph Lange <ralph.lange@gmx.de> 2007-2019
+// GNU Public License (GPLv3) applies - see www.gnu.org
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "procServ.h"
+#include "childInstance.h"
+#include "outputQueue.h"
+
+// Scrollback
+// The most recent party line output (what goes to the log) is kept in a
+// fixed size ring buffer, so that newly connected clients can be shown
+// what happened just before they came in.
+// The ring is allocated once; appending is a (max. two part) memcpy.
+// Every child instance has its own ring, allocated when it gets output.
+
+size_t scrollbackSize = 0;                // Size of the ring, 0: disabled
+long   scrollbackLines = 0;               // Max. lines to replay, 0: all
+ScrollbackTo scrollbackTo = scrollbackAll;  // Who gets the replay
+
+// Parse a size argument (<n>[k|M])
+// Returns false if the argument is not valid
+bool parseScrollbackSize(const char *arg)
+{
+    char *end;
+    long n = strtol(arg, &end, 10);
+
+    if (*end == 'k' || *end == 'K') { n *= 1024; end++; }
+    else if (*end == 'M') { n *= 1024*1024; end++; }
+    if (end == arg || *end || n < 0) return false;
+    scrollbackSize = n;
+    return true;
+}
+
+// Parse the --scrollback-to argument
+// Returns false if the argument is not valid
+bool parseScrollbackTo(const char *arg)
+{
+    if (strcmp(arg, "all") == 0) {
+        scrollbackTo = scrollbackAll;
+    } else if (strcmp(arg, "users") == 0) {
+        scrollbackTo = scrollbackUsers;
+    } else if (strcmp(arg, "loggers") == 0) {
+        scrollbackTo = scrollbackLoggers;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// Add party line output to the ring
+void scrollbackAppend(childInstance *in, const char *buf, size_t len)
+{
+    size_t n;
+    char *&ringBuf = in->ringBuf;
+    size_t &ringHead = in->ringHead;
+    size_t &ringUsed = in->ringUsed;
+
+    if (scrollbackSize == 0 || len == 0) return;
+    if (!ringBuf) ringBuf = (char*) malloc(scrollbackSize);
+    if (!ringBuf) return;
+
+    if (len >= scrollbackSize) {          // Only the tail fits
+        buf += len - scrollbackSize;
+        len = scrollbackSize;
+    }
+    n = scrollbackSize - ringHead;        // Room up to the end of the ring
+    if (n > len) n = len;
+    memcpy(ringBuf + ringHead, buf, n);
+    memcpy(ringBuf, buf + n, len - n);
+    ringHead = (ringHead + len) % scrollbackSize;
+    ringUsed += len;
+    if (ringUsed > scrollbackSize) ringUsed = scrollbackSize;
+}
+
+// Byte at position i (0: oldest) of the ring
+static inline char ringAt(const childInstance *in, size_t i)
+{
+    return in->ringBuf[(in->ringHead + scrollbackSize - in->ringUsed + i) % scrollbackSize];
+}
+
+// Returns the telnet encoded scrollback for a new client, NULL if there
+// is nothing to replay (the caller owns the chunk)
+outputChunk * scrollbackReplay(childInstance *in, bool readonly)
+{
+    size_t start = 0, i;
+    long lines = 0;
+    const char *ringBuf = in->ringBuf;
+    size_t ringHead = in->ringHead;
+    size_t ringUsed = in->ringUsed;
+
+    if (scrollbackSize == 0 || ringUsed == 0) return NULL;
+    if ((scrollbackTo == scrollbackUsers && readonly)
+            || (scrollbackTo == scrollbackLoggers && !readonly)) return NULL;
+
+    // A full ring has most likely cut its first line
+    if (ringUsed == scrollbackSize) {
+        for (i = 0; i < ringUsed && ringAt(in, i) != '\n'; i++);
+        start = i < ringUsed ? i + 1 : 0;
+    }
+
+    // Find the beginning of the last scrollbackLines lines
+    if (scrollbackLines > 0) {
+        for (i = ringUsed - 1; i > start; i--) {
+            if (ringAt(in, i - 1) == '\n' && ++lines == scrollbackLines) {
+                start = i;
+                break;
+            }
+        }
+    }
+    if (start >= ringUsed) return NULL;
+
+    // The data is in (up to) two parts of the ring
+    const char *p1 = ringBuf + (ringHead + scrollbackSize - ringUsed + start) % scrollbackSize;
+    size_t len1 = ringUsed - start;
+    size_t len2 = 0;
+    if (p1 + len1 > ringBuf + scrollbackSize) {
+        len2 = p1 + len1 - (ringBuf + scrollbackSize);
+        len1 -= len2;
+    }
+
+    outputChunk *c = outputChunk::create(outputChunk::escapedSize(p1, len1)
+                                         + outputChunk::escapedSize(ringBuf, len2));
+    c->appendEscaped(p1, len1);
+    c->appendEscaped(ringBuf, len2);
+    return c;
+}